@@ -6,30 +6,58 @@
 #include <sstream>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <regex>
 #include <memory>
 #include <cstdlib>
+#include <cctype>
 #include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <string_view>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <climits>
+#include <chrono>
+#include <functional>
+#include <charconv>
+#include <cxxabi.h>
+#include <unistd.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <csignal>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef THESHIT_ZLIB
+#include <zlib.h>
+#endif
 
 // Utility functions
 namespace utils {
-    std::string to_lower(const std::string& s) {
-        std::string result = s;
+    std::string to_lower(std::string_view s) {
+        std::string result(s);
         std::transform(result.begin(), result.end(), result.begin(), ::tolower);
         return result;
     }
 
-    bool contains(const std::string& str, const std::string& substr) {
-        return str.find(substr) != std::string::npos;
+    bool contains(std::string_view str, std::string_view substr) {
+        return str.find(substr) != std::string_view::npos;
     }
 
-    bool starts_with(const std::string& str, const std::string& prefix) {
-        return str.find(prefix) == 0;
+    bool starts_with(std::string_view str, std::string_view prefix) {
+        return str.substr(0, prefix.size()) == prefix;
     }
 
-    bool ends_with(const std::string& str, const std::string& suffix) {
+    bool ends_with(std::string_view str, std::string_view suffix) {
         return str.size() >= suffix.size() &&
                str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
     }
@@ -53,16 +81,260 @@ namespace utils {
         struct stat buffer;
         return stat(path.c_str(), &buffer) == 0 && S_ISDIR(buffer.st_mode);
     }
+
+    std::string join(const std::vector<std::string>& parts, const std::string& delim = " ") {
+        std::string result;
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (i > 0) result += delim;
+            result += parts[i];
+        }
+        return result;
+    }
+
+    // word as a single shell word: unchanged when it is plain, otherwise
+    // single quoted
+    std::string shell_quote(std::string_view word) {
+        if (!word.empty() && word.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                                    "0123456789@%_+=:,./-") == std::string_view::npos) {
+            return std::string(word);
+        }
+        std::string quoted = "'";
+        for (char c : word) {
+            if (c == '\'') quoted += "'\\''"; else quoted += c;
+        }
+        return quoted + "'";
+    }
+
+    std::string read_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return "";
+        std::ostringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    }
+
+    std::string dirname(const std::string& path) {
+        size_t slash = path.rfind('/');
+        if (slash == std::string::npos) return ".";
+        if (slash == 0) return "/";
+        return path.substr(0, slash);
+    }
+
+    std::string current_dir() {
+        char buffer[4096];
+        if (getcwd(buffer, sizeof(buffer)) == nullptr) return ".";
+        return buffer;
+    }
+
+    // 64-bit FNV-1a, used for cache keys and cheap change detection
+    uint64_t fnv1a(std::string_view data, uint64_t hash = 14695981039346656037ULL) {
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Word-at-a-time hash for output lines, where FNV-1a's byte loop is the
+    // bottleneck on big logs. Not stable across versions; never cache it.
+    uint64_t line_hash(std::string_view line) {
+        uint64_t hash = 0x9E3779B97F4A7C15ULL ^ line.size();
+        size_t i = 0;
+        for (; i + 8 <= line.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, line.data() + i, 8);
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 32;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, line.data() + i, line.size() - i);
+        hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ULL;
+        return hash ^ (hash >> 29);
+    }
+
+    struct LineHash {
+        size_t operator()(std::string_view line) const { return line_hash(line); }
+    };
+}
+
+// Captured output lives in a memfd mapping rather than on the heap: the
+// pipe is spliced straight into the file's pages, the mapping grows with
+// mremap (no copy of what is already there) and rules get string_views
+// into it
+namespace capture {
+    class Buffer {
+    public:
+        Buffer() {
+            fd_ = memfd_create("theshit-output", MFD_CLOEXEC);
+        }
+
+        // Output that is already in memory (tmux, replay) is only copied;
+        // a mapping is for output that is still arriving
+        explicit Buffer(std::string_view data) : heap_(true) {
+            if (data.empty()) return;
+            storage_.assign(data);
+            data_ = storage_.data();
+            size_ = capacity_ = storage_.size();
+        }
+
+        ~Buffer() {
+            if (data_ && !heap_) munmap(data_, capacity_);
+            if (fd_ >= 0) close(fd_);
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        // Move whatever fd has ready into the buffer; false at end of input
+        bool read_from(int fd) {
+            if (!reserve(size_ + 65536)) return false;
+            while (true) {
+                ssize_t n = -1;
+                if (fd_ >= 0 && splice_) {
+                    loff_t offset = size_;
+                    n = splice(fd, nullptr, fd_, &offset, capacity_ - size_, SPLICE_F_MOVE);
+                    // Not a pipe, or an old kernel
+                    if (n < 0 && errno == EINVAL) {
+                        splice_ = false;
+                        continue;
+                    }
+                } else {
+                    n = read(fd, data_ + size_, capacity_ - size_);
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                size_ += n;
+                return true;
+            }
+        }
+
+        std::string_view view() const {
+            return data_ ? std::string_view(data_, size_) : std::string_view();
+        }
+
+    private:
+        // Without memfd (seccomp, old kernels) the same growth works on
+        // anonymous memory, and when mapping fails altogether on the heap
+        bool reserve(size_t size) {
+            if (size <= capacity_) return true;
+            size_t capacity = std::max<size_t>(capacity_ * 2, 1 << 20);
+            while (capacity < size) capacity *= 2;
+
+            if (!heap_) {
+                if (map(capacity)) return true;
+                move_to_heap();
+            }
+            storage_.resize(capacity);
+            data_ = storage_.data();
+            capacity_ = capacity;
+            return true;
+        }
+
+        bool map(size_t capacity) {
+            if (fd_ >= 0 && ftruncate(fd_, capacity) != 0) return false;
+            void* mapped;
+            if (data_) {
+                mapped = mremap(data_, capacity_, capacity, MREMAP_MAYMOVE);
+            } else if (fd_ >= 0) {
+                mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            } else {
+                mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            }
+            if (mapped == MAP_FAILED) return false;
+            data_ = static_cast<char*>(mapped);
+            capacity_ = capacity;
+            return true;
+        }
+
+        void move_to_heap() {
+            if (data_) {
+                storage_.assign(data_, size_);
+                munmap(data_, capacity_);
+            }
+            if (fd_ >= 0) close(fd_);
+            fd_ = -1;
+            data_ = storage_.empty() ? nullptr : storage_.data();
+            capacity_ = storage_.size();
+            heap_ = true;
+        }
+
+        int fd_ = -1;
+        char* data_ = nullptr;
+        size_t size_ = 0;
+        size_t capacity_ = 0;
+        bool splice_ = true;
+        bool heap_ = false;
+        std::string storage_;
+    };
 }
 
+// A distinct line of output: where it first appears in the raw output and
+// how many times it was printed
+struct OutputLine {
+    size_t offset;
+    size_t length;
+    size_t count;
+};
+
 // Command structure
 struct Command {
     std::string script;
-    std::string output;
+    // What rules match against: the output with repeated lines kept only
+    // once, so a warning printed ten thousand times costs one line
+    std::string_view output;
+    // The output as captured, for rules that need the exact text
+    std::string_view raw_output;
+    std::vector<OutputLine> lines;
     std::vector<std::string> script_parts;
+    // The rerun's exit status; -1 when unknown (read back from tmux)
+    int exit_status = -1;
 
-    Command(const std::string& s, const std::string& o) : script(s), output(o) {
+    Command(const std::string& s, std::shared_ptr<const capture::Buffer> captured)
+        : script(s), raw_output(captured->view()), captured_(std::move(captured)) {
         script_parts = utils::split(s);
+        collapse_output();
+    }
+
+    Command(const std::string& s, std::string_view o) : Command(s, std::make_shared<capture::Buffer>(o)) {}
+
+private:
+    // Owners of the views above, shared so that copies stay valid
+    std::shared_ptr<const capture::Buffer> captured_;
+    std::shared_ptr<const std::string> collapsed_;
+
+    void collapse_output() {
+        std::unordered_map<std::string_view, size_t, utils::LineHash> seen;
+        std::string_view raw = raw_output;
+        bool collapsed = false;
+        for (size_t start = 0; start < raw.size();) {
+            size_t end = raw.find('\n', start);
+            end = end == std::string_view::npos ? raw.size() : end + 1;
+            std::string_view line = raw.substr(start, end - start);
+            // Blank lines separate paragraphs; only runs of them collapse
+            bool blank = line.find_first_not_of(" \t\r\n") == std::string_view::npos;
+            if (blank && !lines.empty() && raw.substr(lines.back().offset, lines.back().length) == line) {
+                lines.back().count++;
+                collapsed = true;
+            } else if (auto [it, inserted] = seen.try_emplace(line, lines.size()); !inserted && !blank) {
+                lines[it->second].count++;
+                collapsed = true;
+            } else {
+                lines.push_back({start, line.size(), 1});
+            }
+            start = end;
+        }
+
+        if (!collapsed) {
+            output = raw_output;
+            return;
+        }
+        size_t size = 0;
+        for (const auto& line : lines) size += line.length;
+        auto text = std::make_shared<std::string>();
+        text->reserve(size);
+        for (const auto& line : lines) text->append(raw.substr(line.offset, line.length));
+        collapsed_ = text;
+        output = *collapsed_;
     }
 };
 
@@ -105,8 +377,8 @@ bool GitPushRule::match(const Command& cmd) const {
 }
 std::vector<std::string> GitPushRule::get_new_command(const Command& cmd) const {
     std::regex branch_regex("git push --set-upstream origin ([a-zA-Z0-9_-]+)");
-    std::smatch match;
-    if (std::regex_search(cmd.output, match, branch_regex) && match.size() > 1) {
+    std::cmatch match;
+    if (std::regex_search(cmd.output.data(), cmd.output.data() + cmd.output.size(), match, branch_regex) && match.size() > 1) {
         return {"git push --set-upstream origin " + match[1].str()};
     }
     return {"git push --set-upstream origin master"};
@@ -140,8 +412,8 @@ bool GitNotCommandRule::match(const Command& cmd) const {
 }
 std::vector<std::string> GitNotCommandRule::get_new_command(const Command& cmd) const {
     std::regex did_you_mean("The most similar command is\\s+([a-z]+)");
-    std::smatch match;
-    if (std::regex_search(cmd.output, match, did_you_mean) && match.size() > 1) {
+    std::cmatch match;
+    if (std::regex_search(cmd.output.data(), cmd.output.data() + cmd.output.size(), match, did_you_mean) && match.size() > 1) {
         std::string fixed = "git " + match[1].str();
         for (size_t i = 2; i < cmd.script_parts.size(); i++) {
             fixed += " " + cmd.script_parts[i];
@@ -483,39 +755,6 @@ std::vector<std::string> GitCloneGitCloneRule::get_new_command(const Command& cm
     return {cmd.script.substr(10)};
 }
 
-RULE_CLASS(WrongHyphenBeforeSubcommandRule);
-bool WrongHyphenBeforeSubcommandRule::match(const Command& cmd) const {
-    return utils::contains(cmd.output, "command not found") &&
-           cmd.script_parts.size() > 0 &&
-           utils::contains(cmd.script_parts[0], "-");
-}
-std::vector<std::string> WrongHyphenBeforeSubcommandRule::get_new_command(const Command& cmd) const {
-    std::string fixed = cmd.script;
-    size_t pos = fixed.find('-');
-    if (pos != std::string::npos) {
-        fixed[pos] = ' ';
-    }
-    return {fixed};
-}
-
-RULE_CLASS(MissingSpaceBeforeSubcommandRule);
-bool MissingSpaceBeforeSubcommandRule::match(const Command& cmd) const {
-    return utils::contains(cmd.output, "command not found") &&
-           (utils::starts_with(cmd.script, "npm") ||
-            utils::starts_with(cmd.script, "git") ||
-            utils::starts_with(cmd.script, "apt"));
-}
-std::vector<std::string> MissingSpaceBeforeSubcommandRule::get_new_command(const Command& cmd) const {
-    if (utils::starts_with(cmd.script, "npminstall")) {
-        return {"npm install" + cmd.script.substr(10)};
-    } else if (utils::starts_with(cmd.script, "gitcommit")) {
-        return {"git commit" + cmd.script.substr(9)};
-    } else if (utils::starts_with(cmd.script, "aptinstall")) {
-        return {"apt install" + cmd.script.substr(10)};
-    }
-    return {cmd.script};
-}
-
 RULE_CLASS(RemoveShellPromptLiteralRule);
 bool RemoveShellPromptLiteralRule::match(const Command& cmd) const {
     return utils::starts_with(cmd.script, "$ ");
@@ -590,7 +829,8 @@ std::vector<std::string> GitMainMasterRule::get_new_command(const Command& cmd)
     }
 }
 
-// Settings manager
+// Settings manager. Values come from ~/.config/theshit/config, then
+// THESHIT_* environment variables override them.
 class Settings {
 public:
     bool require_confirmation = true;
@@ -600,14 +840,44 @@ public:
     int wait_command = 3;
     int history_limit = 9999;
     int num_close_matches = 3;
+    // Largest edit distance FuzzyCommandRule accepts
+    int max_distance = 2;
+    // Append every run to sessions.log for --replay
+    bool record = false;
+    // Rule names; DEFAULT_RULES stands for every rule enabled by default
+    std::vector<std::string> rules = {"DEFAULT_RULES"};
+    std::vector<std::string> exclude_rules;
+    std::map<std::string, int> priority;
 
     static Settings& instance() {
         static Settings s;
         return s;
     }
 
+    bool is_rule_enabled(const std::string& name, bool enabled_by_default) const {
+        if (std::find(exclude_rules.begin(), exclude_rules.end(), name) != exclude_rules.end()) return false;
+        if (std::find(rules.begin(), rules.end(), name) != rules.end()) return true;
+        return enabled_by_default && std::find(rules.begin(), rules.end(), "DEFAULT_RULES") != rules.end();
+    }
+
+    int rule_priority(const std::string& name, int fallback) const {
+        auto it = priority.find(name);
+        return it == priority.end() ? fallback : it->second;
+    }
+
+    // "key = value" settings; rules and exclude_rules take comma separated
+    // names, priority takes "Rule=100:OtherRule=900". Returns false on the
+    // first malformed line.
+    bool apply(std::string_view key, std::string_view value);
+    static bool parse_config(std::string_view text, Settings& into);
+
 private:
-    Settings() { load_from_env(); }
+    Settings() {
+        load_config();
+        load_from_env();
+    }
+
+    void load_config();
 
     void load_from_env() {
         const char* env_confirm = std::getenv("THESHIT_REQUIRE_CONFIRMATION");
@@ -618,187 +888,4863 @@ private:
 
         const char* env_debug = std::getenv("THESHIT_DEBUG");
         if (env_debug) debug = std::string(env_debug) == "true";
+
+        const std::pair<const char*, const char*> keys[] = {
+            {"rules", "THESHIT_RULES"},
+            {"exclude_rules", "THESHIT_EXCLUDE_RULES"},
+            {"priority", "THESHIT_PRIORITY"},
+            {"wait_command", "THESHIT_WAIT_COMMAND"},
+            {"history_limit", "THESHIT_HISTORY_LIMIT"},
+            {"num_close_matches", "THESHIT_NUM_CLOSE_MATCHES"},
+            {"max_distance", "THESHIT_MAX_DISTANCE"},
+            {"record", "THESHIT_RECORD"},
+        };
+        for (const auto& [key, name] : keys) {
+            if (const char* env = std::getenv(name)) apply(key, env);
+        }
     }
 };
 
+bool Settings::apply(std::string_view key, std::string_view value) {
+    // Non-negative and in range of int, anything else is invalid
+    auto to_int = [](std::string_view text, int& field) {
+        int parsed = 0;
+        if (text.empty() || text[0] == '-') return false;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        if (error != std::errc() || end != text.data() + text.size()) return false;
+        field = parsed;
+        return true;
+    };
+    auto number = [&](int& field) { return to_int(value, field); };
+    auto flag = [&](bool& field) {
+        if (value != "true" && value != "false") return false;
+        field = value == "true";
+        return true;
+    };
+    auto names = [&](std::vector<std::string>& field) {
+        field.clear();
+        for (auto& name : utils::split(std::string(value), ',')) {
+            name.erase(0, name.find_first_not_of(" \t"));
+            name.erase(name.find_last_not_of(" \t") + 1);
+            if (!name.empty()) field.push_back(name);
+        }
+        return true;
+    };
 
-// Levenshtein distance calculation
-namespace fuzzy {
-    int levenshtein_distance(const std::string& s1, const std::string& s2) {
-        size_t len1 = s1.length();
-        size_t len2 = s2.length();
+    if (key == "require_confirmation") return flag(require_confirmation);
+    if (key == "no_colors") return flag(no_colors);
+    if (key == "debug") return flag(debug);
+    if (key == "alter_history") return flag(alter_history);
+    if (key == "wait_command") return number(wait_command);
+    if (key == "history_limit") return number(history_limit);
+    if (key == "num_close_matches") return number(num_close_matches);
+    if (key == "max_distance") return number(max_distance);
+    if (key == "record") return flag(record);
+    if (key == "rules") return names(rules);
+    if (key == "exclude_rules") return names(exclude_rules);
+    if (key == "priority") {
+        priority.clear();
+        for (const auto& entry : utils::split(std::string(value), ':')) {
+            size_t eq = entry.find('=');
+            int rank = 0;
+            if (eq == std::string::npos || !to_int(std::string_view(entry).substr(eq + 1), rank)) return false;
+            priority[entry.substr(0, eq)] = rank;
+        }
+        return true;
+    }
+    return false;
+}
 
-        std::vector<std::vector<int>> dp(len1 + 1, std::vector<int>(len2 + 1));
+bool Settings::parse_config(std::string_view text, Settings& into) {
+    auto trim = [](std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.remove_suffix(1);
+        return s;
+    };
 
-        for (size_t i = 0; i <= len1; i++) dp[i][0] = i;
-        for (size_t j = 0; j <= len2; j++) dp[0][j] = j;
+    bool ok = true;
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
 
-        for (size_t i = 1; i <= len1; i++) {
-            for (size_t j = 1; j <= len2; j++) {
-                if (s1[i - 1] == s2[j - 1]) {
-                    dp[i][j] = dp[i - 1][j - 1];
-                } else {
-                    dp[i][j] = 1 + std::min({dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]});
-                }
-            }
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        std::string_view value = eq == std::string_view::npos ? "" : trim(line.substr(eq + 1));
+        if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') && value.back() == value.front()) {
+            value = value.substr(1, value.size() - 2);
         }
+        if (eq == std::string_view::npos || !into.apply(trim(line.substr(0, eq)), value)) {
+            if (into.debug) std::cerr << "theshit config: ignoring \"" << line << "\"\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
 
-        return dp[len1][len2];
+
+// On-disk caches under $XDG_CACHE_HOME/theshit
+namespace cache {
+    // Indices that are the same for every user (PATH system directories,
+    // packages, man pages) can be built once by root into a shared
+    // directory; per-user caches then only cover what is left
+    std::string system_directory() {
+        const char* env = std::getenv("THESHIT_SYSTEM_CACHE");
+        return env && *env ? env : "/var/cache/theshit";
     }
 
-    // Get all available commands from system paths
-    std::vector<std::string> get_system_commands() {
-        std::vector<std::string> commands;
-        std::set<std::string> seen; // Track unique commands
+    // Set by --build-system-index: every index is written to the shared
+    // directory instead of the user's
+    bool& building_system() {
+        static bool building = false;
+        return building;
+    }
 
-        const char* path_env = std::getenv("PATH");
-        if (!path_env) return commands;
+    std::string directory() {
+        static std::string dir;
+        if (!dir.empty() && !building_system()) return dir;
+
+        const char* xdg = std::getenv("XDG_CACHE_HOME");
+        const char* home = std::getenv("HOME");
+        if (building_system()) {
+            dir = system_directory();
+        } else if (xdg && *xdg) {
+            dir = std::string(xdg) + "/theshit";
+        } else if (home) {
+            dir = std::string(home) + "/.cache/theshit";
+        } else {
+            dir = "/tmp/theshit-" + std::to_string(getuid());
+        }
 
-        std::string path_str(path_env);
-        std::istringstream iss(path_str);
+        // mkdir -p
+        for (size_t pos = 1; pos != std::string::npos; pos = dir.find('/', pos + 1)) {
+            mkdir(dir.substr(0, pos).c_str(), 0755);
+        }
+        mkdir(dir.c_str(), 0755);
+        return dir;
+    }
+
+    std::string path_for(const std::string& name) {
+        return directory() + "/" + name;
+    }
+
+    // Identity of a source file at the time an index was built. A missing
+    // file is recorded with mtime -1 so that creating it invalidates the cache.
+    struct Stamp {
         std::string path;
+        int64_t mtime = -1;
+        int64_t size = 0;
+    };
 
-        // Split PATH by colons
-        while (std::getline(iss, path, ':')) {
-            if (!utils::is_directory(path)) continue;
+    Stamp stamp_of(const std::string& path) {
+        Stamp stamp;
+        stamp.path = path;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            stamp.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            stamp.size = st.st_size;
+        }
+        return stamp;
+    }
 
-            DIR* dir = opendir(path.c_str());
-            if (!dir) continue;
+    bool is_fresh(const std::vector<Stamp>& stamps) {
+        for (const auto& stamp : stamps) {
+            Stamp now = stamp_of(stamp.path);
+            if (now.mtime != stamp.mtime || now.size != stamp.size) return false;
+        }
+        return true;
+    }
 
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != nullptr) {
-                std::string filename = entry->d_name;
+    // Write to a temp file and rename over the target, so concurrent readers
+    // only ever see the old or the new version
+    bool write_atomic(const std::string& path, std::string_view data) {
+        std::string tmp = path + ".tmp." + std::to_string(getpid());
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
 
-                // Skip hidden files and . and ..
-                if (filename[0] == '.') continue;
+    // A list of names plus the stamps of the files they were read from
+    struct NameList {
+        std::vector<std::string> names;
+        std::vector<Stamp> sources;
+    };
 
-                // Check if it's a regular file (not directory)
-                if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
-                    continue;
-                }
+    // Read-only mapping of a whole file
+    class MappedFile {
+    private:
+        void* addr = MAP_FAILED;
+        size_t length = 0;
 
-                // Check if executable
-                std::string full_path = path + "/" + filename;
-                struct stat st;
-                if (stat(full_path.c_str(), &st) == 0 && (st.st_mode & S_IXUSR)) {
-                    if (seen.find(filename) == seen.end()) {
-                        commands.push_back(filename);
-                        seen.insert(filename);
-                    }
-                }
+    public:
+        explicit MappedFile(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                length = st.st_size;
+                addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
             }
-            closedir(dir);
+            close(fd);
         }
 
-        return commands;
+        ~MappedFile() {
+            if (addr != MAP_FAILED) munmap(addr, length);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool valid() const { return addr != MAP_FAILED; }
+
+        std::string_view data() const {
+            if (!valid()) return {};
+            return {static_cast<const char*>(addr), length};
+        }
+    };
+
+    template <typename T>
+    T load(const char* p) {
+        T value;
+        std::memcpy(&value, p, sizeof(T));
+        return value;
     }
 
-    struct CommandMatch {
-        std::string command;
-        int distance;
+    template <typename T>
+    void store(std::string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    constexpr uint32_t section_id(const char (&tag)[5]) {
+        return static_cast<uint32_t>(tag[0]) | static_cast<uint32_t>(tag[1]) << 8 |
+               static_cast<uint32_t>(tag[2]) << 16 | static_cast<uint32_t>(tag[3]) << 24;
+    }
+
+    // Binary index files are a header, a section table and 8-byte aligned
+    // section payloads. Everything is addressed by offset, so readers use the
+    // mapping as is. The header and section table carry a checksum, and every
+    // section is bounds-checked on open, so a corrupt or foreign file reads
+    // as absent and gets rebuilt. Files are only ever replaced by rename,
+    // which is what lets concurrent processes read them without locks.
+    constexpr char INDEX_MAGIC[8] = {'S', 'H', 'I', 'T', 'I', 'D', 'X', '\0'};
+    constexpr uint32_t INDEX_VERSION = 2;
+
+    struct IndexHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t section_count;
+        uint64_t stamp;
+        // fnv1a of the header (with this field zero) and the section table
+        uint64_t checksum;
     };
 
-    auto compare_matches = [](const CommandMatch& a, const CommandMatch& b) {
-        return a.distance < b.distance;
+    struct SectionEntry {
+        uint32_t id;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
     };
 
-    // Static cache for commands (avoid repeated filesystem scans)
-    class CommandCache {
+    // Section holding the stamps of the files an index was built from:
+    //   u32 count, then per source i64 mtime, i64 size, u32 length, path
+    constexpr uint32_t SOURCES_SECTION = section_id("SRCS");
+
+    uint64_t header_checksum(IndexHeader header, std::string_view table) {
+        header.checksum = 0;
+        uint64_t hash = utils::fnv1a(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+        return utils::fnv1a(table, hash);
+    }
+
+    class IndexWriter {
     private:
-        std::vector<std::string> cached_commands;
-        bool initialized = false;
+        std::vector<std::pair<uint32_t, std::string>> sections;
 
     public:
-        const std::vector<std::string>& get_commands() {
-            if (!initialized) {
-                cached_commands = get_system_commands();
-                initialized = true;
+        void add_section(uint32_t id, std::string data) {
+            sections.emplace_back(id, std::move(data));
+        }
 
-                if (Settings::instance().debug) {
-                    std::cerr << "Loaded " << cached_commands.size() << " system commands\n";
-                }
+        void add_sources(const std::vector<Stamp>& sources) {
+            std::string data;
+            store(data, static_cast<uint32_t>(sources.size()));
+            for (const auto& source : sources) {
+                store(data, source.mtime);
+                store(data, source.size);
+                store(data, static_cast<uint32_t>(source.path.size()));
+                data += source.path;
             }
-            return cached_commands;
+            add_section(SOURCES_SECTION, std::move(data));
+        }
+
+        bool publish(const std::string& path, uint64_t stamp) const {
+            IndexHeader header{};
+            std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+            header.version = INDEX_VERSION;
+            header.section_count = static_cast<uint32_t>(sections.size());
+            header.stamp = stamp;
+
+            std::string table;
+            uint64_t offset = sizeof(IndexHeader) + sections.size() * sizeof(SectionEntry);
+            for (const auto& [id, data] : sections) {
+                offset = (offset + 7) & ~uint64_t(7);
+                SectionEntry entry{id, 0, offset, data.size()};
+                table.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+                offset += data.size();
+            }
+            header.checksum = header_checksum(header, table);
+
+            std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+            out += table;
+            for (const auto& [id, data] : sections) {
+                out.resize((out.size() + 7) & ~size_t(7), '\0');
+                out += data;
+            }
+            return write_atomic(path, out);
         }
     };
 
-    CommandCache& get_command_cache() {
-        static CommandCache cache;
-        return cache;
-    }
+    class IndexReader {
+    private:
+        MappedFile file;
+        bool ok = false;
 
-    std::vector<CommandMatch> find_similar_commands(const std::string& input, int max_distance = 2) {
-        std::vector<CommandMatch> matches;
-        const auto& commands = get_command_cache().get_commands();
+        SectionEntry entry(uint32_t i) const {
+            return load<SectionEntry>(file.data().data() + sizeof(IndexHeader) + i * sizeof(SectionEntry));
+        }
 
-        for (const auto& cmd : commands) {
-            int dist = levenshtein_distance(input, cmd);
-            if (dist <= max_distance) {
-                matches.push_back({cmd, dist});
+    public:
+        explicit IndexReader(const std::string& path) : file(path) {
+            std::string_view data = file.data();
+            if (data.size() < sizeof(IndexHeader)) return;
+            auto header = load<IndexHeader>(data.data());
+            size_t table_end = sizeof(IndexHeader) + static_cast<size_t>(header.section_count) * sizeof(SectionEntry);
+            if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != INDEX_VERSION || data.size() < table_end ||
+                header_checksum(header, data.substr(sizeof(IndexHeader), table_end - sizeof(IndexHeader))) != header.checksum) {
+                return;
+            }
+            for (uint32_t i = 0; i < header.section_count; i++) {
+                auto section = entry(i);
+                if (section.offset % 8 != 0 || section.offset < table_end ||
+                    section.offset > data.size() || section.size > data.size() - section.offset) {
+                    return;
+                }
             }
+            ok = true;
         }
 
-        std::sort(matches.begin(), matches.end(), compare_matches);
-        return matches;
+        bool valid() const { return ok; }
+
+        uint64_t stamp() const {
+            return ok ? load<IndexHeader>(file.data().data()).stamp : 0;
+        }
+
+        std::string_view section(uint32_t id) const {
+            if (!ok) return {};
+            auto header = load<IndexHeader>(file.data().data());
+            for (uint32_t i = 0; i < header.section_count; i++) {
+                auto found = entry(i);
+                if (found.id == id) return file.data().substr(found.offset, found.size);
+            }
+            return {};
+        }
+
+        std::vector<Stamp> sources() const {
+            std::vector<Stamp> stamps;
+            std::string_view data = section(SOURCES_SECTION);
+            if (data.size() < 4) return stamps;
+            uint32_t count = load<uint32_t>(data.data());
+            size_t pos = 4;
+            for (uint32_t i = 0; i < count && pos + 20 <= data.size(); i++) {
+                Stamp stamp;
+                stamp.mtime = load<int64_t>(data.data() + pos);
+                stamp.size = load<int64_t>(data.data() + pos + 8);
+                uint32_t length = load<uint32_t>(data.data() + pos + 16);
+                pos += 20;
+                if (length > data.size() - pos) break;
+                stamp.path = std::string(data.substr(pos, length));
+                pos += length;
+                stamps.push_back(std::move(stamp));
+            }
+            return stamps;
+        }
+    };
+
+    // Name lists share the container: their sources plus the names,
+    // newline separated
+    constexpr uint32_t NAMES_SECTION = section_id("NAMS");
+
+    bool load_name_list(const std::string& path, NameList& list) {
+        IndexReader reader(path);
+        if (!reader.valid()) return false;
+        list.sources = reader.sources();
+        std::string_view names = reader.section(NAMES_SECTION);
+        while (!names.empty()) {
+            size_t newline = names.find('\n');
+            list.names.emplace_back(names.substr(0, newline));
+            names.remove_prefix(newline == std::string_view::npos ? names.size() : newline + 1);
+        }
+        return true;
     }
-}
 
-// Fuzzy Rule - tries to match typos in the main command
-RULE_CLASS(FuzzyCommandRule);
-bool FuzzyCommandRule::match(const Command& cmd) const {
-    // Only match if "command not found" error
-    if (!utils::contains(cmd.output, "command not found")) {
-        return false;
+    void save_name_list(const std::string& path, const NameList& list) {
+        IndexWriter writer;
+        writer.add_sources(list.sources);
+        writer.add_section(NAMES_SECTION, utils::join(list.names, "\n"));
+        writer.publish(path, 0);
     }
 
-    if (cmd.script_parts.empty()) {
-        return false;
+    // Combine stamps of source paths into one value stored in the header
+    uint64_t combined_stamp(const std::vector<std::string>& paths) {
+        uint64_t hash = utils::fnv1a("");
+        for (const auto& path : paths) {
+            Stamp stamp = stamp_of(path);
+            hash = utils::fnv1a(path, hash);
+            hash = utils::fnv1a(std::string_view(reinterpret_cast<const char*>(&stamp.mtime), sizeof(stamp.mtime)), hash);
+            hash = utils::fnv1a(std::string_view(reinterpret_cast<const char*>(&stamp.size), sizeof(stamp.size)), hash);
+        }
+        return hash;
     }
 
-    // Check if there are similar commands
-    auto matches = fuzzy::find_similar_commands(cmd.script_parts[0]);
-    return !matches.empty();
-}
+    // String-to-string hash table serialized as one relocatable section:
+    //   u32 bucket_count, u32 entry_count, u32 buckets[bucket_count],
+    //   MapEntry entries[entry_count] (sorted by key), string pool.
+    // Buckets hold entry index + 1, 0 marks an empty bucket. Lookups are a
+    // hash and a short linear probe.
+    struct MapEntry {
+        uint32_t hash;
+        uint32_t key_offset;
+        uint32_t key_length;
+        uint32_t value_offset;
+        uint32_t value_length;
+    };
 
-std::vector<std::string> FuzzyCommandRule::get_new_command(const Command& cmd) const {
-    if (cmd.script_parts.empty()) {
-        return {};
+    uint32_t map_hash(std::string_view key) {
+        uint64_t h = utils::fnv1a(key);
+        return static_cast<uint32_t>(h ^ (h >> 32));
     }
 
-    auto matches = fuzzy::find_similar_commands(cmd.script_parts[0], 3);
-    std::vector<std::string> suggestions;
+    class HashMapBuilder {
+    private:
+        std::map<std::string, std::string> entries;
 
-    // Create suggestions for each close match
-    for (size_t i = 0; i < matches.size() && i < 3; i++) {
-        std::string fixed = matches[i].command;
-        for (size_t j = 1; j < cmd.script_parts.size(); j++) {
-            fixed += " " + cmd.script_parts[j];
+    public:
+        // Values added under an existing key are kept, newline separated
+        void add(const std::string& key, const std::string& value) {
+            auto [it, inserted] = entries.try_emplace(key, value);
+            if (inserted) return;
+            for (const auto& line : utils::split(it->second, '\n')) {
+                if (line == value) return;
+            }
+            it->second += "\n" + value;
         }
-        suggestions.push_back(fixed);
-    }
 
-    return suggestions;
-}
+        size_t size() const { return entries.size(); }
 
-// Rule Manager
-class RuleManager {
-private:
-    std::vector<std::unique_ptr<Rule>> rules;
+        // Keys in entry id order
+        std::vector<std::string_view> keys() const {
+            std::vector<std::string_view> result;
+            result.reserve(entries.size());
+            for (const auto& entry : entries) result.emplace_back(entry.first);
+            return result;
+        }
 
-public:
-    RuleManager() {
-        // Register all rules
-        rules.push_back(std::make_unique<SudoRule>());
-        rules.push_back(std::make_unique<FuzzyCommandRule>());
-        rules.push_back(std::make_unique<GitPushRule>());
-        rules.push_back(std::make_unique<NoCommandRule>());
-        rules.push_back(std::make_unique<GitNotCommandRule>());
-        rules.push_back(std::make_unique<CdMkdirRule>());
-        rules.push_back(std::make_unique<CdParentRule>());
-        rules.push_back(std::make_unique<CdCsRule>());
-        rules.push_back(std::make_unique<CatDirRule>());
-        rules.push_back(std::make_unique<ChmodXRule>());
-        rules.push_back(std::make_unique<CpOmittingDirectoryRule>());
+        std::string serialize() const {
+            uint32_t bucket_count = 16;
+            while (bucket_count < entries.size() * 2) bucket_count *= 2;
+
+            std::vector<uint32_t> buckets(bucket_count, 0);
+            std::vector<MapEntry> table;
+            std::string pool;
+            for (const auto& [key, value] : entries) {
+                MapEntry entry{map_hash(key), static_cast<uint32_t>(pool.size()), static_cast<uint32_t>(key.size()), 0, 0};
+                pool += key;
+                entry.value_offset = static_cast<uint32_t>(pool.size());
+                entry.value_length = static_cast<uint32_t>(value.size());
+                pool += value;
+
+                uint32_t slot = entry.hash & (bucket_count - 1);
+                while (buckets[slot] != 0) slot = (slot + 1) & (bucket_count - 1);
+                buckets[slot] = static_cast<uint32_t>(table.size()) + 1;
+                table.push_back(entry);
+            }
+
+            std::string out;
+            store(out, bucket_count);
+            store(out, static_cast<uint32_t>(table.size()));
+            out.append(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint32_t));
+            out.append(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(MapEntry));
+            out += pool;
+            return out;
+        }
+    };
+
+    class HashMapView {
+    private:
+        std::string_view blob;
+        uint32_t bucket_count = 0;
+        uint32_t entry_count = 0;
+
+        MapEntry entry(uint32_t i) const {
+            return load<MapEntry>(blob.data() + 8 + bucket_count * 4 + i * sizeof(MapEntry));
+        }
+
+        std::string_view pool(uint32_t offset, uint32_t length) const {
+            size_t base = 8 + static_cast<size_t>(bucket_count) * 4 + static_cast<size_t>(entry_count) * sizeof(MapEntry);
+            if (base + offset + length > blob.size()) return {};
+            return blob.substr(base + offset, length);
+        }
+
+    public:
+        HashMapView() = default;
+        explicit HashMapView(std::string_view b) : blob(b) {
+            if (blob.size() < 8) return;
+            bucket_count = load<uint32_t>(blob.data());
+            entry_count = load<uint32_t>(blob.data() + 4);
+            size_t needed = 8 + static_cast<size_t>(bucket_count) * 4 + static_cast<size_t>(entry_count) * sizeof(MapEntry);
+            if (needed > blob.size() || (bucket_count & (bucket_count - 1)) != 0) {
+                bucket_count = entry_count = 0;
+            }
+        }
+
+        size_t size() const { return entry_count; }
+        std::string_view key(uint32_t i) const { auto e = entry(i); return pool(e.key_offset, e.key_length); }
+        std::string_view value(uint32_t i) const { auto e = entry(i); return pool(e.value_offset, e.value_length); }
+
+        // Entries are sorted by key: first id whose key is not less than key
+        uint32_t lower_bound(std::string_view key) const {
+            uint32_t lo = 0, hi = entry_count;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (this->key(mid) < key) lo = mid + 1; else hi = mid;
+            }
+            return lo;
+        }
+
+        std::optional<std::string_view> find(std::string_view key) const {
+            if (bucket_count == 0) return std::nullopt;
+            uint32_t hash = map_hash(key);
+            // A table without an empty slot can only come from a damaged
+            // file; stop after one round
+            uint32_t slot = hash & (bucket_count - 1);
+            for (uint32_t probes = 0; probes < bucket_count; probes++, slot = (slot + 1) & (bucket_count - 1)) {
+                uint32_t index = load<uint32_t>(blob.data() + 8 + slot * 4);
+                if (index == 0 || index > entry_count) return std::nullopt;
+                MapEntry e = entry(index - 1);
+                if (e.hash == hash && pool(e.key_offset, e.key_length) == key) {
+                    return pool(e.value_offset, e.value_length);
+                }
+            }
+            return std::nullopt;
+        }
+    };
+
+    // Cache file name for one key of a kind of index: "<kind>-<hash>"
+    std::string hashed_name(const std::string& kind, std::string_view key) {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(utils::fnv1a(key)));
+        return kind + "-" + hex;
+    }
+
+    // Hashed names are keyed by things like $PATH or a project directory, so
+    // every venv or checkout leaves one behind. Only the most recently used
+    // HASHED_KEEP of each kind are kept; a reused file is touched so that its
+    // mtime tracks its last use.
+    const size_t HASHED_KEEP = 16;
+
+    // Kind of a "<kind>-<hash>.idx" file name, empty for any other name
+    std::string hashed_kind(std::string_view name) {
+        const size_t HASH = 1 + 16 + 4;
+        if (name.size() <= HASH || !utils::ends_with(name, ".idx") || name[name.size() - HASH] != '-') return "";
+        std::string_view hex = name.substr(name.size() - HASH + 1, 16);
+        if (hex.find_first_not_of("0123456789abcdef") != std::string_view::npos) return "";
+        return std::string(name.substr(0, name.size() - HASH));
+    }
+
+    void touch(const std::string& name) {
+        if (!hashed_kind(name).empty()) utimensat(AT_FDCWD, path_for(name).c_str(), nullptr, 0);
+    }
+
+    // Remove all but the HASHED_KEEP newest files of the kind of name
+    void evict(const std::string& name) {
+        std::string kind = hashed_kind(name);
+        if (kind.empty()) return;
+        DIR* handle = opendir(directory().c_str());
+        if (!handle) return;
+        std::vector<std::pair<int64_t, std::string>> files;
+        while (struct dirent* entry = readdir(handle)) {
+            struct stat st;
+            if (hashed_kind(entry->d_name) != kind || fstatat(dirfd(handle), entry->d_name, &st, 0) != 0) continue;
+            files.emplace_back(static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, entry->d_name);
+        }
+        if (files.size() > HASHED_KEEP) {
+            std::sort(files.begin(), files.end(), std::greater<>());
+            for (size_t i = HASHED_KEEP; i < files.size(); i++) unlinkat(dirfd(handle), files[i].second.c_str(), 0);
+        }
+        closedir(handle);
+    }
+
+    // Open name from the cache directory, rebuilding it first when the
+    // stored stamp no longer matches the sources. Only shareable indices
+    // are looked for in the shared directory; nothing else is built there.
+    template <typename Builder>
+    std::unique_ptr<IndexReader> open_index(const std::string& name, uint64_t stamp, Builder build,
+                                            bool shareable = false) {
+        // The shared copy is used while it is current
+        if (shareable && !building_system()) {
+            auto shared = std::make_unique<IndexReader>(system_directory() + "/" + name);
+            if (shared->valid() && shared->stamp() == stamp) return shared;
+        }
+
+        std::string path = path_for(name);
+        auto reader = std::make_unique<IndexReader>(path);
+        if (reader->valid() && reader->stamp() == stamp) {
+            touch(name);
+            return reader;
+        }
+
+        IndexWriter writer;
+        build(writer);
+        writer.publish(path, stamp);
+        evict(name);
+        return std::make_unique<IndexReader>(path);
+    }
+
+    // Return the cached list for key, rebuilding it when any source changed
+    template <typename Builder>
+    std::vector<std::string> cached_names(const std::string& kind, const std::string& key, Builder build) {
+        std::string name = hashed_name(kind, key) + ".idx";
+        std::string path = path_for(name);
+
+        NameList list;
+        if (load_name_list(path, list) && is_fresh(list.sources)) {
+            touch(name);
+            return list.names;
+        }
+
+        list = build();
+        save_name_list(path, list);
+        evict(name);
+        return list.names;
+    }
+}
+
+// The config file is parsed once per change: the result is kept as a
+// snapshot index keyed by the file's stamp, so later runs only map it
+void Settings::load_config() {
+    const char* xdg = std::getenv("XDG_CONFIG_HOME");
+    const char* home = std::getenv("HOME");
+    std::string path = xdg && *xdg ? std::string(xdg) + "/theshit/config"
+                                   : std::string(home ? home : "") + "/.config/theshit/config";
+    cache::Stamp stamp = cache::stamp_of(path);
+    if (stamp.mtime < 0) return;
+
+    const uint32_t VALUES = cache::section_id("CFGV");
+    const uint32_t NAMES = cache::section_id("CFGN");
+    struct Values {
+        uint8_t require_confirmation, no_colors, debug, alter_history, record;
+        int32_t wait_command, history_limit, num_close_matches, max_distance;
+    };
+
+    std::string snapshot = cache::path_for("config.idx");
+    cache::IndexReader reader(snapshot);
+    auto sources = reader.sources();
+    std::string_view values = reader.section(VALUES);
+    if (sources.size() != 1 || sources[0].path != path || sources[0].mtime != stamp.mtime ||
+        sources[0].size != stamp.size || values.size() != sizeof(Values)) {
+        Settings parsed(*this);
+        parse_config(utils::read_file(path), parsed);
+
+        Values v{parsed.require_confirmation, parsed.no_colors, parsed.debug, parsed.alter_history, parsed.record,
+                 parsed.wait_command, parsed.history_limit, parsed.num_close_matches, parsed.max_distance};
+        // One "R name", "X name" or "P name rank" line per rule setting
+        std::string names;
+        for (const auto& rule : parsed.rules) names += "R " + rule + "\n";
+        for (const auto& rule : parsed.exclude_rules) names += "X " + rule + "\n";
+        for (const auto& [rule, rank] : parsed.priority) names += "P " + rule + " " + std::to_string(rank) + "\n";
+
+        cache::IndexWriter writer;
+        writer.add_sources({stamp});
+        writer.add_section(VALUES, std::string(reinterpret_cast<const char*>(&v), sizeof(v)));
+        writer.add_section(NAMES, names);
+        writer.publish(snapshot, 0);
+        *this = std::move(parsed);
+        return;
+    }
+
+    auto v = cache::load<Values>(values.data());
+    require_confirmation = v.require_confirmation;
+    no_colors = v.no_colors;
+    debug = v.debug;
+    alter_history = v.alter_history;
+    record = v.record;
+    wait_command = v.wait_command;
+    history_limit = v.history_limit;
+    num_close_matches = v.num_close_matches;
+    max_distance = v.max_distance;
+    rules.clear();
+    std::istringstream lines{std::string(reader.section(NAMES))};
+    std::string kind, name;
+    while (lines >> kind >> name) {
+        if (kind == "R") rules.push_back(name);
+        if (kind == "X") exclude_rules.push_back(name);
+        if (kind == "P") lines >> priority[name];
+    }
+}
+
+// Parallel directory walker shared by the file-system backed indices.
+// Entries are classified with fstatat against the open directory fd, so
+// nothing re-resolves full paths per entry.
+namespace scan {
+    struct Directory {
+        std::string path;
+        int64_t mtime = 0;
+        std::vector<std::string> files;
+        std::vector<std::string> subdirs;
+    };
+
+    struct Options {
+        int max_depth = 64;
+        size_t max_dirs = 100000;
+        // Only list regular files with an execute bit
+        bool executables_only = false;
+        // Subdirectory names that are never entered
+        std::set<std::string> skip;
+    };
+
+    int64_t mtime_of(const struct stat& st) {
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    // List an already opened directory; takes ownership of fd
+    void read_entries(int fd, Directory& dir, bool executables_only) {
+        DIR* handle = fdopendir(fd);
+        if (!handle) {
+            close(fd);
+            return;
+        }
+        while (struct dirent* entry = readdir(handle)) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            // One fstatat per entry at most: the mode is reused for the
+            // execute check of a resolved symlink
+            unsigned char type = entry->d_type;
+            struct stat st;
+            bool stated = false;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                if (fstatat(fd, name, &st, 0) != 0) continue;
+                stated = true;
+                // Symlinked directories are not followed, they can form cycles
+                if (type == DT_LNK && S_ISDIR(st.st_mode)) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type == DT_REG && executables_only) {
+                if (!stated && fstatat(fd, name, &st, 0) != 0) continue;
+                if (!S_ISREG(st.st_mode) || !(st.st_mode & S_IXUSR)) continue;
+            }
+            if (type == DT_DIR) {
+                dir.subdirs.emplace_back(name);
+            } else if (type == DT_REG) {
+                dir.files.emplace_back(name);
+            }
+        }
+        closedir(handle);
+    }
+
+    // Walk roots on all cores. reuse(path, mtime, dir) may fill dir from a
+    // previous walk and return true, which skips readdir for directories
+    // whose mtime did not change.
+    template <typename Reuse>
+    std::vector<Directory> walk(const std::vector<std::string>& roots, const Options& options, Reuse reuse) {
+        std::vector<Directory> result;
+        std::deque<std::pair<std::string, int>> queue;
+        for (const auto& root : roots) queue.emplace_back(root, 0);
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        size_t active = 0;
+        size_t visited = 0;
+
+        auto worker = [&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [&]() { return !queue.empty() || active == 0; });
+                if (queue.empty()) return;
+
+                auto [path, depth] = std::move(queue.front());
+                queue.pop_front();
+                if (visited++ >= options.max_dirs) continue;
+                active++;
+                lock.unlock();
+
+                Directory dir;
+                dir.path = path;
+                bool ok = false;
+                int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                struct stat st;
+                if (fd >= 0 && fstat(fd, &st) == 0) {
+                    ok = true;
+                    dir.mtime = mtime_of(st);
+                    if (reuse(path, dir.mtime, dir)) {
+                        close(fd);
+                    } else {
+                        read_entries(fd, dir, options.executables_only);
+                    }
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+
+                lock.lock();
+                if (ok) {
+                    if (depth < options.max_depth) {
+                        for (const auto& sub : dir.subdirs) {
+                            if (!options.skip.count(sub)) queue.emplace_back(path + "/" + sub, depth + 1);
+                        }
+                    }
+                    result.push_back(std::move(dir));
+                }
+                active--;
+                wake.notify_all();
+            }
+        };
+
+        unsigned count = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < count; i++) threads.emplace_back(worker);
+        worker();
+        for (auto& thread : threads) thread.join();
+
+        std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) { return a.path < b.path; });
+        return result;
+    }
+
+    std::vector<Directory> walk(const std::vector<std::string>& roots, const Options& options) {
+        return walk(roots, options, [](const std::string&, int64_t, Directory&) { return false; });
+    }
+}
+
+// Names the shell resolves before PATH: builtins of each shell, plus the
+// aliases and functions the shell hook passes in THESHIT_ALIASES and
+// THESHIT_FUNCTIONS
+namespace shell {
+    constexpr const char* BASH_BUILTINS[] = {
+        "alias", "bg", "bind", "break", "builtin", "caller", "cd", "command", "compgen", "complete",
+        "compopt", "continue", "declare", "dirs", "disown", "echo", "enable", "eval", "exec", "exit",
+        "export", "false", "fc", "fg", "getopts", "hash", "help", "history", "jobs", "kill", "let",
+        "local", "logout", "mapfile", "popd", "printf", "pushd", "pwd", "read", "readarray", "readonly",
+        "return", "set", "shift", "shopt", "source", "suspend", "test", "times", "trap", "true", "type",
+        "typeset", "ulimit", "umask", "unalias", "unset", "wait"};
+    constexpr const char* ZSH_BUILTINS[] = {
+        "alias", "autoload", "bg", "bindkey", "break", "builtin", "bye", "cd", "chdir", "command",
+        "compdef", "declare", "dirs", "disable", "disown", "echo", "emulate", "enable", "eval", "exec",
+        "exit", "export", "false", "fc", "fg", "float", "functions", "getopts", "hash", "history",
+        "integer", "jobs", "kill", "let", "limit", "local", "logout", "noglob", "popd", "print",
+        "printf", "pushd", "pushln", "pwd", "read", "readonly", "rehash", "return", "sched", "set",
+        "setopt", "shift", "source", "suspend", "test", "times", "trap", "true", "ttyctl", "type",
+        "typeset", "ulimit", "umask", "unalias", "unfunction", "unhash", "unlimit", "unset",
+        "unsetopt", "vared", "wait", "whence", "where", "which", "zcompile", "zle", "zmodload",
+        "zparseopts", "zstyle"};
+    constexpr const char* FISH_BUILTINS[] = {
+        "abbr", "and", "argparse", "begin", "bg", "bind", "block", "break", "breakpoint", "builtin",
+        "case", "cd", "command", "commandline", "complete", "contains", "continue", "count", "disown",
+        "echo", "else", "emit", "end", "eval", "exec", "exit", "false", "fg", "for", "function",
+        "functions", "history", "if", "jobs", "math", "not", "or", "printf", "pwd", "random", "read",
+        "realpath", "return", "set", "set_color", "source", "status", "string", "switch", "test",
+        "time", "true", "type", "ulimit", "wait", "while"};
+
+    // bash, zsh or fish, from $SHELL
+    std::string current() {
+        const char* env = std::getenv("SHELL");
+        std::string name = env ? env : "";
+        name = name.substr(name.rfind('/') + 1);
+        return name == "zsh" || name == "fish" ? name : "bash";
+    }
+
+    std::vector<std::string> builtins(const std::string& shell) {
+        if (shell == "zsh") return {std::begin(ZSH_BUILTINS), std::end(ZSH_BUILTINS)};
+        if (shell == "fish") return {std::begin(FISH_BUILTINS), std::end(FISH_BUILTINS)};
+        return {std::begin(BASH_BUILTINS), std::end(BASH_BUILTINS)};
+    }
+
+    // The hook definition printed by --alias. It hands the current alias and
+    // function names over in the environment on every run.
+    std::string hook(const std::string& shell) {
+        if (shell == "zsh") {
+            return "alias shit='eval $(THESHIT_ALIASES=\"${(k)aliases}\" THESHIT_FUNCTIONS=\"${(k)functions}\" "
+                   "theshit $(fc -ln -1))'\n";
+        }
+        if (shell == "fish") {
+            return "function shit\n"
+                   "    set -lx THESHIT_FUNCTIONS (functions --names)\n"
+                   "    eval (theshit)\n"
+                   "end\n";
+        }
+        return "alias shit='eval $(THESHIT_ALIASES=\"$(compgen -a)\" THESHIT_FUNCTIONS=\"$(compgen -A function)\" "
+               "theshit $(fc -ln -1))'\n";
+    }
+
+    struct Names {
+        std::vector<std::string> aliases;
+        std::vector<std::string> functions;
+    };
+
+    std::vector<std::string> words(std::string_view text) {
+        std::vector<std::string> result;
+        std::istringstream iss{std::string(text)};
+        std::string word;
+        while (iss >> word) result.push_back(word);
+        return result;
+    }
+
+    // Names from the hook, persisted so runs without the hook still see
+    // them. The index stamp is the content hash, so the file is only
+    // rewritten when the names change.
+    Names user_names(const std::string& shell) {
+        const uint32_t ALIASES = cache::section_id("ALIA");
+        const uint32_t FUNCTIONS = cache::section_id("FUNC");
+        std::string path = cache::path_for("shell-" + shell + ".idx");
+        const char* aliases = std::getenv("THESHIT_ALIASES");
+        const char* functions = std::getenv("THESHIT_FUNCTIONS");
+
+        Names names;
+        if (!aliases && !functions) {
+            cache::IndexReader reader(path);
+            names.aliases = words(reader.section(ALIASES));
+            names.functions = words(reader.section(FUNCTIONS));
+            return names;
+        }
+
+        // zsh joins names with spaces, bash and fish with newlines
+        names.aliases = words(aliases ? aliases : "");
+        for (auto& name : words(functions ? functions : "")) {
+            // Functions starting with _ are completion helpers and internals
+            if (name[0] != '_') names.functions.push_back(std::move(name));
+        }
+        std::string alias_list = utils::join(names.aliases, "\n");
+        std::string function_list = utils::join(names.functions, "\n");
+        uint64_t hash = utils::fnv1a(function_list, utils::fnv1a(alias_list));
+
+        if (cache::IndexReader(path).stamp() != hash) {
+            cache::IndexWriter writer;
+            writer.add_section(ALIASES, alias_list);
+            writer.add_section(FUNCTIONS, function_list);
+            writer.publish(path, hash);
+        }
+        return names;
+    }
+}
+
+// Shell history files, parsed in place over a mapping of the file. Each
+// format is a reader with the same static interface, so anything that
+// walks history works for all of them:
+//   record_end(data, start)  end of the record starting at start: its
+//                            terminating newline or data.size()
+//   record_start(data, end)  start of the record ending at end
+//   sync(data, pos)          first record start at or after pos
+//   parse(record)            the record's fields
+//   decode(command)          the command as the user typed it
+namespace history {
+    enum class Format { Bash, Zsh, Fish };
+
+    // One history record. command points into the file and is still in
+    // the file's encoding; text() decodes it.
+    struct Entry {
+        int64_t timestamp = 0;
+        int64_t duration = 0;
+        std::string_view command;
+        Format format = Format::Bash;
+
+        std::string text() const;
+    };
+
+    int64_t parse_number(std::string_view& s) {
+        int64_t value = 0;
+        while (!s.empty() && s[0] >= '0' && s[0] <= '9') {
+            value = value * 10 + (s[0] - '0');
+            s.remove_prefix(1);
+        }
+        return value;
+    }
+
+    size_t line_end(std::string_view data, size_t pos) {
+        size_t newline = data.find('\n', pos);
+        return newline == std::string_view::npos ? data.size() : newline;
+    }
+
+    size_t line_start(std::string_view data, size_t pos) {
+        if (pos == 0) return 0;
+        size_t newline = data.rfind('\n', pos - 1);
+        return newline == std::string_view::npos ? 0 : newline + 1;
+    }
+
+    // zsh writes each record as ": <start>:<elapsed>;<command>" when
+    // EXTENDED_HISTORY is set and as the bare command otherwise. Newlines
+    // inside a command are written as "\\\n", and bytes that clash with
+    // its internal tokens as 0x83 followed by the byte xor 32 (metafied).
+    struct Zsh {
+        static constexpr char META = '\x83';
+
+        // The first newline that does not continue the command
+        static size_t record_end(std::string_view data, size_t pos) {
+            while (true) {
+                size_t newline = data.find('\n', pos);
+                if (newline == std::string_view::npos) return data.size();
+                if (newline == 0 || data[newline - 1] != '\\') return newline;
+                pos = newline + 1;
+            }
+        }
+
+        static size_t record_start(std::string_view data, size_t end) {
+            size_t pos = end;
+            while (pos > 0) {
+                size_t newline = data.rfind('\n', pos - 1);
+                if (newline == std::string_view::npos) return 0;
+                if (newline == 0 || data[newline - 1] != '\\') return newline + 1;
+                pos = newline;
+            }
+            return 0;
+        }
+
+        static size_t sync(std::string_view data, size_t pos) {
+            if (pos == 0) return 0;
+            size_t end = record_end(data, pos - 1);
+            return std::min(end + 1, data.size());
+        }
+
+        static Entry parse(std::string_view record) {
+            Entry entry;
+            entry.format = Format::Zsh;
+            entry.command = record;
+            std::string_view rest = record;
+            if (rest.size() < 2 || rest[0] != ':' || rest[1] != ' ') return entry;
+
+            rest.remove_prefix(2);
+            int64_t timestamp = parse_number(rest);
+            if (rest.empty() || rest[0] != ':') return entry;
+            rest.remove_prefix(1);
+            int64_t duration = parse_number(rest);
+            if (rest.empty() || rest[0] != ';') return entry;
+
+            entry.timestamp = timestamp;
+            entry.duration = duration;
+            entry.command = rest.substr(1);
+            return entry;
+        }
+
+        static std::string decode(std::string_view raw) {
+            std::string text;
+            text.reserve(raw.size());
+            for (size_t i = 0; i < raw.size(); i++) {
+                if (raw[i] == META && i + 1 < raw.size()) {
+                    text += static_cast<char>(raw[++i] ^ 32);
+                } else if (raw[i] == '\\' && i + 1 < raw.size() && raw[i + 1] == '\n') {
+                    text += '\n';
+                    i++;
+                } else {
+                    text += raw[i];
+                }
+            }
+            return text;
+        }
+    };
+
+    // One command per line; with HISTTIMEFORMAT set, bash precedes each
+    // with a "#<epoch>" line
+    struct Bash {
+        static bool is_timestamp(std::string_view line) {
+            return line.size() > 1 && line[0] == '#' &&
+                   std::all_of(line.begin() + 1, line.end(), [](char c) { return c >= '0' && c <= '9'; });
+        }
+
+        static size_t record_end(std::string_view data, size_t pos) {
+            size_t end = line_end(data, pos);
+            if (is_timestamp(data.substr(pos, end - pos)) && end < data.size()) end = line_end(data, end + 1);
+            return end;
+        }
+
+        static size_t record_start(std::string_view data, size_t end) {
+            size_t start = line_start(data, end);
+            if (start == 0) return 0;
+            size_t previous = line_start(data, start - 1);
+            return is_timestamp(data.substr(previous, start - 1 - previous)) ? previous : start;
+        }
+
+        static size_t sync(std::string_view data, size_t pos) {
+            size_t start = pos == 0 || data[pos - 1] == '\n' ? pos : std::min(line_end(data, pos) + 1, data.size());
+            if (start == 0 || start >= data.size()) return start;
+            // A command line right after a timestamp belongs to it
+            size_t previous = line_start(data, start - 1);
+            bool stamped = is_timestamp(data.substr(previous, start - 1 - previous));
+            bool stamp = is_timestamp(data.substr(start, line_end(data, start) - start));
+            return stamped && !stamp ? std::min(line_end(data, start) + 1, data.size()) : start;
+        }
+
+        static Entry parse(std::string_view record) {
+            Entry entry;
+            entry.format = Format::Bash;
+            entry.command = record;
+            size_t newline = record.find('\n');
+            if (newline != std::string_view::npos && is_timestamp(record.substr(0, newline))) {
+                std::string_view digits = record.substr(1, newline - 1);
+                entry.timestamp = parse_number(digits);
+                entry.command = record.substr(newline + 1);
+            }
+            return entry;
+        }
+
+        static std::string decode(std::string_view raw) {
+            return std::string(raw);
+        }
+    };
+
+    // fish_history is YAML-like:
+    //   - cmd: git status
+    //     when: 1700000000
+    //     paths:
+    //       - src
+    // where cmd escapes backslashes as \\ and newlines as \n
+    struct Fish {
+        static constexpr std::string_view MARKER = "\n- cmd: ";
+
+        static size_t record_end(std::string_view data, size_t pos) {
+            size_t next = data.find(MARKER, pos);
+            if (next != std::string_view::npos) return next;
+            return !data.empty() && data.back() == '\n' ? data.size() - 1 : data.size();
+        }
+
+        static size_t record_start(std::string_view data, size_t end) {
+            if (end == 0) return 0;
+            size_t found = data.rfind(MARKER, end - 1);
+            return found == std::string_view::npos ? 0 : found + 1;
+        }
+
+        static size_t sync(std::string_view data, size_t pos) {
+            if (pos == 0) return 0;
+            size_t found = data.find(MARKER, pos - 1);
+            return found == std::string_view::npos ? data.size() : found + 1;
+        }
+
+        static Entry parse(std::string_view record) {
+            Entry entry;
+            entry.format = Format::Fish;
+            if (record.substr(0, MARKER.size() - 1) != MARKER.substr(1)) return entry;
+            size_t end = line_end(record, 0);
+            entry.command = record.substr(MARKER.size() - 1, end - (MARKER.size() - 1));
+
+            size_t when = record.find("\n  when: ", end);
+            if (when != std::string_view::npos) {
+                std::string_view digits = record.substr(when + 9);
+                entry.timestamp = parse_number(digits);
+            }
+            return entry;
+        }
+
+        static std::string decode(std::string_view raw) {
+            std::string text;
+            text.reserve(raw.size());
+            for (size_t i = 0; i < raw.size(); i++) {
+                if (raw[i] == '\\' && i + 1 < raw.size() && (raw[i + 1] == 'n' || raw[i + 1] == '\\')) {
+                    text += raw[++i] == 'n' ? '\n' : '\\';
+                } else {
+                    text += raw[i];
+                }
+            }
+            return text;
+        }
+    };
+
+    // Call fn with the reader for format
+    template <typename Fn>
+    auto with_reader(Format format, Fn fn) {
+        switch (format) {
+            case Format::Zsh: return fn(Zsh{});
+            case Format::Fish: return fn(Fish{});
+            case Format::Bash: break;
+        }
+        return fn(Bash{});
+    }
+
+    std::string Entry::text() const {
+        return with_reader(format, [&](auto reader) { return decltype(reader)::decode(command); });
+    }
+
+    // visit(entry) for each record of data, oldest first; stop early when
+    // visit returns false
+    template <typename Reader, typename Visitor>
+    void for_each(std::string_view data, Visitor visit) {
+        for (size_t pos = Reader::sync(data, 0); pos < data.size();) {
+            size_t end = Reader::record_end(data, pos);
+            if (end > pos && !visit(Reader::parse(data.substr(pos, end - pos)))) return;
+            pos = end + 1;
+        }
+    }
+
+    // The same, newest first, without touching older records
+    template <typename Reader, typename Visitor>
+    void for_each_reverse(std::string_view data, Visitor visit) {
+        size_t end = data.size();
+        if (end > 0 && data[end - 1] == '\n') end--;
+        while (end > 0) {
+            size_t start = Reader::record_start(data, end);
+            if (end > start && !visit(Reader::parse(data.substr(start, end - start)))) return;
+            if (start == 0) return;
+            end = start - 1;
+        }
+    }
+
+    template <typename Visitor>
+    void for_each(Format format, std::string_view data, Visitor visit) {
+        with_reader(format, [&](auto reader) { for_each<decltype(reader)>(data, visit); });
+    }
+
+    template <typename Visitor>
+    void for_each_reverse(Format format, std::string_view data, Visitor visit) {
+        with_reader(format, [&](auto reader) { for_each_reverse<decltype(reader)>(data, visit); });
+    }
+
+    struct Source {
+        std::string path;
+        Format format = Format::Bash;
+    };
+
+    // The current shell's history file; $HISTFILE wins for bash and zsh,
+    // $fish_history selects fish's session file
+    Source current_source() {
+        Source source;
+        std::string shell = shell::current();
+        const char* home = std::getenv("HOME");
+        std::string home_dir = home ? home : "";
+        const char* histfile = std::getenv("HISTFILE");
+
+        if (shell == "fish") {
+            source.format = Format::Fish;
+            const char* data = std::getenv("XDG_DATA_HOME");
+            std::string dir = data && *data ? std::string(data) : home_dir + "/.local/share";
+            const char* session = std::getenv("fish_history");
+            std::string name = session && *session ? session : "fish";
+            if (name == "default") name = "fish";
+            source.path = dir + "/fish/" + name + "_history";
+        } else if (shell == "zsh") {
+            source.format = Format::Zsh;
+            source.path = histfile && *histfile ? histfile : home_dir + "/.zsh_history";
+        } else {
+            source.path = histfile && *histfile ? histfile : home_dir + "/.bash_history";
+        }
+        return source;
+    }
+
+    // Where an index built from a history file stopped reading it
+    struct Checkpoint {
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        // First byte not yet consumed: the start of an incomplete record
+        uint64_t offset = 0;
+        // Bumped on every full rebuild
+        uint64_t generation = 0;
+        // Hash of the bytes just before offset, to notice a rewritten file
+        uint64_t fingerprint = 0;
+    };
+
+    uint64_t fingerprint(std::string_view data, size_t offset) {
+        size_t start = offset > 64 ? offset - 64 : 0;
+        return utils::fnv1a(data.substr(start, offset - start));
+    }
+
+    // End of the complete records of data: a record the shell is still
+    // writing is left for the next run
+    template <typename Reader>
+    size_t complete_end(std::string_view data) {
+        if (data.empty() || data.back() == '\n') return data.size();
+        return Reader::record_start(data, data.size());
+    }
+
+    // Fold the records of data[begin, end) into a State. The range is cut
+    // into one chunk per core, each moved forward to a record boundary,
+    // and the per-chunk states are merged in file order.
+    template <typename Reader, typename State>
+    State parse_parallel(std::string_view data, size_t begin, size_t end) {
+        unsigned count = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+        // Appended tails are small; threads only pay off on rebuilds
+        if (end - begin < (1u << 20)) count = 1;
+
+        std::vector<size_t> bounds = {begin};
+        for (unsigned i = 1; i < count; i++) {
+            bounds.push_back(std::clamp(Reader::sync(data, begin + (end - begin) * i / count), bounds.back(), end));
+        }
+        bounds.push_back(end);
+
+        std::vector<State> states(count);
+        auto worker = [&](unsigned i) {
+            for (size_t pos = bounds[i]; pos < bounds[i + 1];) {
+                size_t record_end = Reader::record_end(data, pos);
+                if (record_end > pos) states[i].add(Reader::parse(data.substr(pos, record_end - pos)));
+                pos = record_end + 1;
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < count; i++) threads.emplace_back(worker, i);
+        worker(0);
+        for (auto& thread : threads) thread.join();
+
+        for (unsigned i = 1; i < count; i++) states[0].merge(states[i]);
+        return std::move(states[0]);
+    }
+
+    // Bring the index called kind up to date with source and return it.
+    // Only the bytes appended since the last run are parsed; rotation,
+    // truncation or a rewrite start over from byte 0. State provides
+    // add(entry), merge(state), load(reader) and store(writer).
+    template <typename State>
+    std::unique_ptr<cache::IndexReader> ingest(const Source& source, const std::string& kind) {
+        const uint32_t CHECKPOINT = cache::section_id("CKPT");
+        std::string path = cache::path_for(cache::hashed_name("history-" + kind, source.path) + ".idx");
+        auto reader = std::make_unique<cache::IndexReader>(path);
+
+        struct stat st;
+        if (stat(source.path.c_str(), &st) != 0) return reader;
+        Checkpoint now;
+        now.inode = st.st_ino;
+        now.size = st.st_size;
+        now.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+        Checkpoint last;
+        std::string_view saved = reader->section(CHECKPOINT);
+        bool resumable = saved.size() == sizeof(Checkpoint);
+        if (resumable) last = cache::load<Checkpoint>(saved.data());
+        if (resumable && last.inode == now.inode && last.size == now.size && last.mtime == now.mtime) {
+            return reader;
+        }
+
+        cache::MappedFile file(source.path);
+        std::string_view data = file.data().substr(0, now.size);
+        resumable = resumable && last.inode == now.inode && last.offset <= data.size() &&
+                    fingerprint(data, last.offset) == last.fingerprint;
+
+        State state;
+        if (resumable) state.load(*reader);
+        now.generation = resumable ? last.generation : last.generation + 1;
+        size_t begin = resumable ? last.offset : 0;
+
+        with_reader(source.format, [&](auto format) {
+            using Reader = decltype(format);
+            now.offset = std::max<size_t>(begin, complete_end<Reader>(data));
+            state.merge(parse_parallel<Reader, State>(data, begin, now.offset));
+        });
+        now.fingerprint = fingerprint(data, now.offset);
+
+        cache::IndexWriter writer;
+        writer.add_section(CHECKPOINT, std::string(reinterpret_cast<const char*>(&now), sizeof(now)));
+        state.store(writer);
+        writer.publish(path, now.generation);
+        return std::make_unique<cache::IndexReader>(path);
+    }
+
+    // How often each command name was run
+    struct Frequencies {
+        std::map<std::string, uint64_t> counts;
+
+        void add(const Entry& entry) {
+            std::string text = entry.text();
+            std::string_view rest(text), word;
+            // Leading assignments and sudo do not name the command
+            do {
+                size_t start = rest.find_first_not_of(" \t\n");
+                if (start == std::string_view::npos) return;
+                rest.remove_prefix(start);
+                word = rest.substr(0, rest.find_first_of(" \t\n"));
+                rest.remove_prefix(word.size());
+            } while (word == "sudo" || word.find('=') != std::string_view::npos);
+            counts[std::string(word)]++;
+        }
+
+        void merge(const Frequencies& other) {
+            for (const auto& [word, count] : other.counts) counts[word] += count;
+        }
+
+        void load(const cache::IndexReader& reader) {
+            cache::HashMapView view(reader.section(cache::section_id("FREQ")));
+            for (uint32_t i = 0; i < view.size(); i++) {
+                counts[std::string(view.key(i))] += std::strtoull(std::string(view.value(i)).c_str(), nullptr, 10);
+            }
+        }
+
+        void store(cache::IndexWriter& writer) const {
+            cache::HashMapBuilder map;
+            for (const auto& [word, count] : counts) map.add(word, std::to_string(count));
+            writer.add_section(cache::section_id("FREQ"), map.serialize());
+        }
+    };
+
+    // Runs of command in the current shell's history
+    uint64_t frequency(const std::string& command) {
+        static std::unique_ptr<cache::IndexReader> reader;
+        static cache::HashMapView view;
+        if (!reader) {
+            reader = ingest<Frequencies>(current_source(), "frequency");
+            view = cache::HashMapView(reader->section(cache::section_id("FREQ")));
+        }
+        auto count = view.find(command);
+        return count ? std::strtoull(std::string(*count).c_str(), nullptr, 10) : 0;
+    }
+}
+
+// Levenshtein distance calculation
+namespace fuzzy {
+    int levenshtein_distance(const std::string& s1, const std::string& s2) {
+        size_t len1 = s1.length();
+        size_t len2 = s2.length();
+
+        std::vector<std::vector<int>> dp(len1 + 1, std::vector<int>(len2 + 1));
+
+        for (size_t i = 0; i <= len1; i++) dp[i][0] = i;
+        for (size_t j = 0; j <= len2; j++) dp[0][j] = j;
+
+        for (size_t i = 1; i <= len1; i++) {
+            for (size_t j = 1; j <= len2; j++) {
+                if (s1[i - 1] == s2[j - 1]) {
+                    dp[i][j] = dp[i - 1][j - 1];
+                } else {
+                    dp[i][j] = 1 + std::min({dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]});
+                }
+            }
+        }
+
+        return dp[len1][len2];
+    }
+
+    // Directories of PATH, in order, without duplicates
+    std::vector<std::string> path_dirs() {
+        std::vector<std::string> dirs;
+        const char* path_env = std::getenv("PATH");
+        if (!path_env) return dirs;
+        for (const auto& dir : utils::split(path_env, ':')) {
+            if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end() && utils::is_directory(dir)) {
+                dirs.push_back(dir);
+            }
+        }
+        return dirs;
+    }
+
+    // Command -> every directory of dirs containing it, in dirs order
+    void write_path_map(const std::vector<std::string>& dirs, cache::IndexWriter& writer) {
+        scan::Options options;
+        options.max_depth = 0;
+        options.executables_only = true;
+        auto listings = scan::walk(dirs, options);
+
+        cache::HashMapBuilder index;
+        for (const auto& dir : dirs) {
+            for (const auto& listing : listings) {
+                if (listing.path != dir) continue;
+                for (const auto& file : listing.files) {
+                    if (file[0] != '.') index.add(file, dir);
+                }
+            }
+        }
+        writer.add_section(cache::section_id("PATH"), index.serialize());
+    }
+
+    // Directories the shared index covers: the usual system directories
+    // and any root-owned PATH entry outside home directories
+    std::vector<std::string> system_path_dirs() {
+        std::vector<std::string> dirs;
+        auto add = [&](const std::string& dir) {
+            struct stat st;
+            if (stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == 0 &&
+                !utils::starts_with(dir, "/home/") && !utils::starts_with(dir, "/root") &&
+                std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+                dirs.push_back(dir);
+            }
+        };
+        for (const char* dir : {"/usr/local/sbin", "/usr/local/bin", "/usr/sbin", "/usr/bin", "/sbin", "/bin",
+                                "/usr/games", "/usr/local/games", "/snap/bin"}) {
+            add(dir);
+        }
+        for (const auto& dir : path_dirs()) add(dir);
+        return dirs;
+    }
+
+    // Executables on PATH, layered: directories covered by a current
+    // shared index come from it, the rest from a per-user overlay built
+    // only for those. Lookups rank directories by PATH order across both.
+    class PathIndex {
+    private:
+        std::unique_ptr<cache::IndexReader> base_reader, user_reader;
+        cache::HashMapView base, user;
+        std::map<std::string, size_t, std::less<>> rank;
+        std::set<std::string, std::less<>> covered;
+        std::vector<std::string_view> keys;
+
+        // Earliest PATH directory of value, if any
+        std::optional<std::string_view> first_dir(std::string_view value, bool from_base) const {
+            std::optional<std::string_view> best;
+            size_t best_rank = SIZE_MAX;
+            while (!value.empty()) {
+                size_t newline = value.find('\n');
+                std::string_view dir = value.substr(0, newline);
+                value.remove_prefix(newline == std::string_view::npos ? value.size() : newline + 1);
+                auto it = rank.find(dir);
+                if (it == rank.end() || (from_base && !covered.count(dir))) continue;
+                if (it->second < best_rank) {
+                    best_rank = it->second;
+                    best = dir;
+                }
+            }
+            return best;
+        }
+
+    public:
+        PathIndex() {
+            auto dirs = path_dirs();
+            for (size_t i = 0; i < dirs.size(); i++) rank.emplace(dirs[i], i);
+
+            base_reader = std::make_unique<cache::IndexReader>(cache::system_directory() + "/path-system.idx");
+            for (const auto& source : base_reader->sources()) {
+                cache::Stamp now = cache::stamp_of(source.path);
+                if (rank.count(source.path) && now.mtime == source.mtime && now.size == source.size) {
+                    covered.insert(source.path);
+                }
+            }
+            if (!covered.empty()) base = cache::HashMapView(base_reader->section(cache::section_id("PATH")));
+
+            std::vector<std::string> rest;
+            for (const auto& dir : dirs) {
+                if (!covered.count(dir)) rest.push_back(dir);
+            }
+            std::string name = cache::hashed_name("path", utils::join(rest, ":")) + ".idx";
+            user_reader = cache::open_index(name, cache::combined_stamp(rest), [&](cache::IndexWriter& writer) {
+                write_path_map(rest, writer);
+            });
+            user = cache::HashMapView(user_reader->section(cache::section_id("PATH")));
+
+            // Both key lists are sorted: merge them
+            for (uint32_t i = 0, j = 0; i < base.size() || j < user.size();) {
+                if (j == user.size() || (i < base.size() && base.key(i) < user.key(j))) {
+                    if (first_dir(base.value(i), true)) keys.push_back(base.key(i));
+                    i++;
+                } else {
+                    if (i < base.size() && base.key(i) == user.key(j)) i++;
+                    keys.push_back(user.key(j++));
+                }
+            }
+        }
+
+        // Directory the shell would run command from
+        std::optional<std::string_view> find(std::string_view command) const {
+            std::optional<std::string_view> best;
+            if (auto value = user.find(command)) best = first_dir(*value, false);
+            if (auto value = base.find(command)) {
+                auto dir = first_dir(*value, true);
+                if (dir && (!best || rank.find(*dir)->second < rank.find(*best)->second)) best = dir;
+            }
+            return best;
+        }
+
+        uint32_t size() const { return static_cast<uint32_t>(keys.size()); }
+        std::string_view key(uint32_t i) const { return keys[i]; }
+
+        uint32_t lower_bound(std::string_view key) const {
+            return static_cast<uint32_t>(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+        }
+    };
+
+    const PathIndex& path_index() {
+        static PathIndex index;
+        return index;
+    }
+
+    // Root only: the shared index of the system directories, stamped per
+    // directory so users can tell which parts are still current
+    bool build_system_path_index() {
+        auto dirs = system_path_dirs();
+        cache::IndexWriter writer;
+        std::vector<cache::Stamp> stamps;
+        for (const auto& dir : dirs) stamps.push_back(cache::stamp_of(dir));
+        writer.add_sources(stamps);
+        write_path_map(dirs, writer);
+        return writer.publish(cache::path_for("path-system.idx"), 0);
+    }
+
+    // Get all available commands from system paths
+    std::vector<std::string> get_system_commands() {
+        std::vector<std::string> commands;
+        const auto& index = path_index();
+        commands.reserve(index.size());
+        for (uint32_t i = 0; i < index.size(); i++) {
+            commands.emplace_back(index.key(i));
+        }
+        return commands;
+    }
+
+    struct CommandMatch {
+        std::string command;
+        int distance;
+    };
+
+    auto compare_matches = [](const CommandMatch& a, const CommandMatch& b) {
+        return a.distance < b.distance;
+    };
+
+    // Where a command candidate comes from. At equal distance, what the user
+    // defined wins over what the shell ships, which wins over PATH.
+    enum class Source { Alias, Function, Builtin, Path };
+
+    int source_weight(Source source) {
+        switch (source) {
+            case Source::Alias: return 0;
+            case Source::Function: return 1;
+            case Source::Builtin: return 2;
+            case Source::Path: return 3;
+        }
+        return 3;
+    }
+
+    struct Candidate {
+        std::string name;
+        Source source;
+    };
+
+    // Static cache for commands (avoid repeated filesystem scans)
+    class CommandCache {
+    private:
+        std::vector<Candidate> cached_commands;
+        bool initialized = false;
+
+    public:
+        const std::vector<Candidate>& get_commands() {
+            if (!initialized) {
+                std::string current = shell::current();
+                auto user = shell::user_names(current);
+                std::set<std::string> seen;
+                auto add = [&](const std::vector<std::string>& names, Source source) {
+                    for (const auto& name : names) {
+                        if (seen.insert(name).second) cached_commands.push_back({name, source});
+                    }
+                };
+                add(user.aliases, Source::Alias);
+                add(user.functions, Source::Function);
+                add(shell::builtins(current), Source::Builtin);
+                add(get_system_commands(), Source::Path);
+                initialized = true;
+
+                if (Settings::instance().debug) {
+                    std::cerr << "Loaded " << cached_commands.size() << " commands ("
+                              << user.aliases.size() << " aliases, " << user.functions.size() << " functions)\n";
+                }
+            }
+            return cached_commands;
+        }
+    };
+
+    CommandCache& get_command_cache() {
+        static CommandCache cache;
+        return cache;
+    }
+
+    // Whether a correction needs the user's shell: any command in it that
+    // is an alias, a function or a builtin means /bin/sh can't run it
+    bool runs_in_shell(std::string_view correction) {
+        const auto& commands = get_command_cache().get_commands();
+        bool command_word = true;
+        std::string word;
+        std::istringstream iss{std::string(correction)};
+        while (iss >> word) {
+            if (word == "&&" || word == "||" || word == ";" || word == "|") {
+                command_word = true;
+                continue;
+            }
+            if (!command_word) continue;
+            command_word = false;
+            if (!word.empty() && word.back() == ';') {
+                word.pop_back();
+                command_word = true;
+            }
+            for (const auto& cmd : commands) {
+                if (cmd.name == word) {
+                    if (cmd.source != Source::Path) return true;
+                    break;
+                }
+            }
+        }
+        return false;
+    }
+
+    std::vector<CommandMatch> find_similar_commands(const std::string& input, int max_distance = 2) {
+        std::vector<std::pair<int, CommandMatch>> scored;
+        const auto& commands = get_command_cache().get_commands();
+
+        for (const auto& cmd : commands) {
+            int dist = levenshtein_distance(input, cmd.name);
+            if (dist <= max_distance) {
+                scored.push_back({dist * 4 + source_weight(cmd.source), {cmd.name, dist}});
+            }
+        }
+
+        std::stable_sort(scored.begin(), scored.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        // Remaining ties go to the command the user runs most
+        for (size_t i = 0; i < scored.size();) {
+            size_t j = i;
+            while (j < scored.size() && scored[j].first == scored[i].first) j++;
+            if (j - i > 1) {
+                std::stable_sort(scored.begin() + i, scored.begin() + j, [](const auto& a, const auto& b) {
+                    return history::frequency(a.second.command) > history::frequency(b.second.command);
+                });
+            }
+            i = j;
+        }
+        std::vector<CommandMatch> matches;
+        for (auto& entry : scored) matches.push_back(std::move(entry.second));
+        return matches;
+    }
+
+    // Optimal string alignment distance: Levenshtein plus adjacent
+    // transpositions, so "tset" -> "test" costs 1 instead of 2. Gives up with
+    // max_distance + 1 as soon as a whole row exceeds the budget.
+    int osa_distance(std::string_view a, std::string_view b, int max_distance) {
+        int n = static_cast<int>(a.size());
+        int m = static_cast<int>(b.size());
+        if (std::abs(n - m) > max_distance) return max_distance + 1;
+
+        thread_local std::vector<int> prev2, prev, cur;
+        prev2.assign(m + 1, 0);
+        prev.resize(m + 1);
+        cur.resize(m + 1);
+        for (int j = 0; j <= m; j++) prev[j] = j;
+
+        for (int i = 1; i <= n; i++) {
+            cur[0] = i;
+            int row_min = i;
+            for (int j = 1; j <= m; j++) {
+                int cost = a[i - 1] == b[j - 1] ? 0 : 1;
+                int value = std::min({prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + cost});
+                if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+                    value = std::min(value, prev2[j - 2] + 1);
+                }
+                cur[j] = value;
+                row_min = std::min(row_min, value);
+            }
+            if (row_min > max_distance) return max_distance + 1;
+            std::swap(prev2, prev);
+            std::swap(prev, cur);
+        }
+        return std::min(prev[m], max_distance + 1);
+    }
+
+    // Edit budget for a word: short words tolerate fewer edits
+    int max_distance_for(std::string_view word) {
+        if (word.size() <= 4) return 1;
+        if (word.size() <= 8) return 2;
+        return 3;
+    }
+
+    // The fuzzy kernel shared by every index-backed rule: rank candidates by
+    // OSA distance to input. Exact matches are skipped, they are not fixes.
+    template <typename Range>
+    std::vector<CommandMatch> closest_matches(std::string_view input, const Range& candidates,
+                                              int max_distance, size_t limit = 3) {
+        std::vector<CommandMatch> matches;
+        for (const auto& candidate : candidates) {
+            std::string_view name(candidate);
+            if (name == input) continue;
+            int dist = osa_distance(input, name, max_distance);
+            if (dist <= max_distance) {
+                matches.push_back({std::string(name), dist});
+            }
+        }
+
+        std::stable_sort(matches.begin(), matches.end(), compare_matches);
+        if (matches.size() > limit) matches.resize(limit);
+        return matches;
+    }
+
+    template <typename Range>
+    std::vector<CommandMatch> closest_matches(std::string_view input, const Range& candidates) {
+        return closest_matches(input, candidates, max_distance_for(input));
+    }
+}
+
+// Fuzzy Rule - tries to match typos in the main command
+RULE_CLASS(FuzzyCommandRule);
+bool FuzzyCommandRule::match(const Command& cmd) const {
+    // Only match if "command not found" error
+    if (!utils::contains(cmd.output, "command not found")) {
+        return false;
+    }
+
+    if (cmd.script_parts.empty()) {
+        return false;
+    }
+
+    // Check if there are similar commands
+    auto matches = fuzzy::find_similar_commands(cmd.script_parts[0], Settings::instance().max_distance);
+    return !matches.empty();
+}
+
+std::vector<std::string> FuzzyCommandRule::get_new_command(const Command& cmd) const {
+    if (cmd.script_parts.empty()) {
+        return {};
+    }
+
+    const auto& settings = Settings::instance();
+    auto matches = fuzzy::find_similar_commands(cmd.script_parts[0], settings.max_distance + 1);
+    std::vector<std::string> suggestions;
+
+    // Create suggestions for each close match
+    for (size_t i = 0; i < matches.size() && i < static_cast<size_t>(settings.num_close_matches); i++) {
+        std::string fixed = matches[i].command;
+        for (size_t j = 1; j < cmd.script_parts.size(); j++) {
+            fixed += " " + cmd.script_parts[j];
+        }
+        suggestions.push_back(fixed);
+    }
+
+    return suggestions;
+}
+
+// Splits a glued or hyphenated token into (command, subcommand):
+// "gitcommit" -> git commit, "npm-isntall" -> npm install
+namespace segment {
+    // Subcommands of tools whose CLI is subcommand-driven
+    const std::map<std::string, std::vector<std::string>>& dictionaries() {
+        static const std::map<std::string, std::vector<std::string>> tables = {
+            {"git", {"add", "am", "apply", "archive", "bisect", "blame", "branch", "bundle", "checkout",
+                     "cherry-pick", "clean", "clone", "commit", "config", "describe", "diff", "fetch",
+                     "format-patch", "gc", "grep", "init", "log", "merge", "mv", "notes", "pull", "push",
+                     "rebase", "reflog", "remote", "reset", "restore", "revert", "rm", "shortlog", "show",
+                     "stash", "status", "submodule", "switch", "tag", "worktree"}},
+            {"npm", {"access", "adduser", "audit", "bugs", "cache", "ci", "config", "dedupe", "deprecate",
+                     "diff", "dist-tag", "docs", "doctor", "edit", "exec", "explain", "explore", "fund",
+                     "help", "init", "install", "link", "login", "logout", "ls", "outdated", "owner", "pack",
+                     "ping", "prefix", "prune", "publish", "rebuild", "restart", "root", "run", "search",
+                     "start", "stop", "test", "uninstall", "unpublish", "update", "version", "view", "whoami"}},
+            {"yarn", {"add", "audit", "bin", "cache", "config", "create", "dlx", "global", "info", "init",
+                      "install", "link", "list", "login", "logout", "outdated", "pack", "publish", "remove",
+                      "run", "test", "unlink", "upgrade", "version", "why", "workspace", "workspaces"}},
+            {"pnpm", {"add", "audit", "dlx", "exec", "install", "link", "list", "outdated", "publish",
+                      "remove", "run", "store", "test", "update", "why"}},
+            {"apt", {"autoclean", "autoremove", "build-dep", "changelog", "clean", "depends", "download",
+                     "full-upgrade", "install", "list", "policy", "purge", "rdepends", "reinstall", "remove",
+                     "search", "show", "source", "update", "upgrade"}},
+            {"apt-get", {"autoclean", "autoremove", "build-dep", "check", "clean", "dist-upgrade", "download",
+                         "install", "purge", "remove", "source", "update", "upgrade"}},
+            {"cargo", {"add", "bench", "build", "check", "clean", "clippy", "doc", "fetch", "fix", "fmt",
+                       "init", "install", "metadata", "new", "publish", "remove", "run", "search", "test",
+                       "tree", "uninstall", "update"}},
+            {"docker", {"attach", "build", "commit", "compose", "container", "cp", "create", "diff", "events",
+                        "exec", "export", "history", "image", "images", "import", "info", "inspect", "kill",
+                        "load", "login", "logout", "logs", "network", "pause", "port", "ps", "pull", "push",
+                        "rename", "restart", "rm", "rmi", "run", "save", "search", "start", "stats", "stop",
+                        "system", "tag", "top", "unpause", "update", "version", "volume", "wait"}},
+            {"kubectl", {"annotate", "apply", "attach", "auth", "autoscale", "cluster-info", "config",
+                         "cordon", "cp", "create", "delete", "describe", "diff", "drain", "edit", "exec",
+                         "explain", "expose", "get", "label", "logs", "patch", "port-forward", "proxy",
+                         "rollout", "run", "scale", "set", "taint", "top", "uncordon", "version", "wait"}},
+            {"systemctl", {"cat", "daemon-reload", "disable", "edit", "enable", "is-active", "is-enabled",
+                           "is-failed", "kill", "list-timers", "list-unit-files", "list-units", "mask",
+                           "reload", "restart", "show", "start", "status", "stop", "unmask"}},
+            {"pip", {"cache", "check", "config", "debug", "download", "freeze", "hash", "index", "inspect",
+                     "install", "list", "search", "show", "uninstall", "wheel"}},
+            {"pip3", {"cache", "check", "config", "debug", "download", "freeze", "hash", "index", "inspect",
+                      "install", "list", "search", "show", "uninstall", "wheel"}},
+            {"go", {"build", "clean", "doc", "env", "fix", "fmt", "generate", "get", "install", "list",
+                    "mod", "run", "test", "tool", "version", "vet", "work"}},
+            {"brew", {"cleanup", "doctor", "info", "install", "list", "outdated", "reinstall", "search",
+                      "services", "tap", "uninstall", "untap", "update", "upgrade"}},
+            {"dnf", {"autoremove", "check-update", "clean", "downgrade", "group", "history", "info",
+                     "install", "list", "makecache", "reinstall", "remove", "repolist", "search", "update",
+                     "upgrade"}},
+            {"snap", {"find", "info", "install", "list", "refresh", "remove", "revert", "run", "services"}},
+            {"terraform", {"apply", "console", "destroy", "fmt", "get", "graph", "import", "init", "output",
+                           "plan", "providers", "refresh", "show", "state", "taint", "validate", "workspace"}},
+        };
+        return tables;
+    }
+
+    // The table for tool plus tool-<name> executables on PATH, which most
+    // of these tools dispatch to (git-lfs, cargo-clippy, kubectl-krew)
+    const std::vector<std::string>& subcommands_of(const std::string& tool) {
+        static std::map<std::string, std::vector<std::string>> memo;
+        auto cached = memo.find(tool);
+        if (cached != memo.end()) return cached->second;
+
+        std::vector<std::string> words;
+        auto table = dictionaries().find(tool);
+        if (table != dictionaries().end()) words = table->second;
+        const auto& path = fuzzy::path_index();
+        std::string prefix = tool + "-";
+        for (uint32_t i = path.lower_bound(prefix); i < path.size(); i++) {
+            std::string_view key = path.key(i);
+            if (key.substr(0, prefix.size()) != prefix) break;
+            std::string word(key.substr(prefix.size()));
+            if (!word.empty() && std::find(words.begin(), words.end(), word) == words.end()) words.push_back(word);
+        }
+        return memo.emplace(tool, std::move(words)).first->second;
+    }
+
+    struct Split {
+        std::string command;
+        std::string subcommand;
+        int cost;
+        // The split consumed a '-' standing in for the space
+        bool at_hyphen;
+    };
+
+    // Closest words within budget, including an exact match at cost 0. The
+    // distance is at least the difference in length, so only words of a
+    // nearby length are compared at all
+    std::vector<fuzzy::CommandMatch> probe(std::string_view piece, const std::vector<std::string>& words, int budget) {
+        std::vector<fuzzy::CommandMatch> found;
+        for (const auto& word : words) {
+            size_t longer = std::max(word.size(), piece.size());
+            if (longer - std::min(word.size(), piece.size()) > static_cast<size_t>(budget)) continue;
+            int distance = fuzzy::osa_distance(piece, word, budget);
+            if (distance <= budget) found.push_back({word, distance});
+        }
+        return found;
+    }
+
+    // Installed tools that have subcommands
+    const std::vector<std::string>& tools() {
+        static std::vector<std::string> installed;
+        static bool loaded = false;
+        if (!loaded) {
+            loaded = true;
+            const auto& path = fuzzy::path_index();
+            for (const auto& table : dictionaries()) {
+                if (path.find(table.first)) installed.push_back(table.first);
+            }
+        }
+        return installed;
+    }
+
+    // Short pieces must be exact, "gi" is not a typo of anything
+    int piece_budget(std::string_view piece) {
+        return piece.size() < 3 ? 0 : fuzzy::max_distance_for(piece);
+    }
+
+    // Probes of one piece against one dictionary ("" for the tools, else
+    // the tool's subcommands) at the piece's full budget, memoized: the
+    // split points of a token, and both rules in match and
+    // get_new_command, keep asking for the same pieces
+    const std::vector<fuzzy::CommandMatch>& probe_memo(const std::string& dictionary, std::string_view piece) {
+        static std::map<std::pair<std::string, std::string>, std::vector<fuzzy::CommandMatch>> memo;
+        auto key = std::make_pair(dictionary, std::string(piece));
+        auto cached = memo.find(key);
+        if (cached != memo.end()) return cached->second;
+
+        int budget = piece_budget(piece);
+        auto found = dictionary.empty() ? probe(piece, tools(), budget)
+                                        : probe(piece, subcommands_of(dictionary), budget);
+        if (dictionary.empty()) {
+            // Any installed tool with tool-* subcommands, spelled exactly
+            const auto& listed = tools();
+            if (std::find(listed.begin(), listed.end(), key.second) == listed.end() &&
+                fuzzy::path_index().find(key.second) && !subcommands_of(key.second).empty()) {
+                found.push_back({key.second, 0});
+            }
+        }
+        return memo.emplace(std::move(key), std::move(found)).first->second;
+    }
+
+    // Best segmentations of token into tool and subcommand, cheapest
+    // first. A split point is either between two letters or a '-' that
+    // replaces the space. With two pieces the segmentation is a single
+    // pass over the split points; every (dictionary, piece) probe is
+    // memoized, and since only words of a nearby length are compared, each
+    // dictionary word meets a bounded number of pieces however long the
+    // token is.
+    std::vector<Split> split(const std::string& token) {
+        static std::map<std::string, std::vector<Split>> memo;
+        auto cached = memo.find(token);
+        if (cached != memo.end()) return cached->second;
+
+        std::vector<Split> splits;
+        int total_budget = std::max(1, fuzzy::max_distance_for(token) - 1);
+        for (size_t i = 1; i + 1 < token.size(); i++) {
+            bool at_hyphen = token[i] == '-';
+            size_t rest = at_hyphen ? i + 1 : i;
+            if (token[i - 1] == '-') continue;
+
+            std::string_view prefix(token.data(), i);
+            std::string_view suffix(token.data() + rest, token.size() - rest);
+            for (const auto& command : probe_memo("", prefix)) {
+                int budget = std::min(total_budget - command.distance, piece_budget(suffix));
+                if (budget < 0) continue;
+                for (const auto& sub : probe_memo(command.command, suffix)) {
+                    if (sub.distance > budget) continue;
+                    splits.push_back({command.command, sub.command, command.distance + sub.distance, at_hyphen});
+                }
+            }
+        }
+
+        std::stable_sort(splits.begin(), splits.end(), [](const Split& a, const Split& b) { return a.cost < b.cost; });
+        // Different split points can land on the same pair
+        std::vector<Split> unique;
+        for (const auto& split : splits) {
+            bool seen = std::any_of(unique.begin(), unique.end(), [&](const Split& other) {
+                return other.command == split.command && other.subcommand == split.subcommand;
+            });
+            if (!seen && unique.size() < 3) unique.push_back(split);
+        }
+        memo[token] = unique;
+        return unique;
+    }
+
+    // The script with its first word replaced by each segmentation, when
+    // the best one is of the requested kind
+    std::vector<std::string> fix_first_word(const Command& cmd, bool at_hyphen) {
+        if (cmd.script_parts.empty()) return {};
+        auto splits = split(cmd.script_parts[0]);
+        if (splits.empty() || splits[0].at_hyphen != at_hyphen) return {};
+
+        std::vector<std::string> fixes;
+        for (const auto& split : splits) {
+            auto parts = cmd.script_parts;
+            parts[0] = split.command + " " + split.subcommand;
+            fixes.push_back(utils::join(parts));
+        }
+        return fixes;
+    }
+}
+
+RULE_CLASS(WrongHyphenBeforeSubcommandRule);
+bool WrongHyphenBeforeSubcommandRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "command not found") &&
+           cmd.script_parts.size() > 0 &&
+           utils::contains(cmd.script_parts[0], "-") &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> WrongHyphenBeforeSubcommandRule::get_new_command(const Command& cmd) const {
+    return segment::fix_first_word(cmd, true);
+}
+
+RULE_CLASS(MissingSpaceBeforeSubcommandRule);
+bool MissingSpaceBeforeSubcommandRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "command not found") &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> MissingSpaceBeforeSubcommandRule::get_new_command(const Command& cmd) const {
+    return segment::fix_first_word(cmd, false);
+}
+
+// Minimal JSON scanner: just enough to list the keys of a top-level object
+namespace json {
+    class Scanner {
+    private:
+        std::string_view text;
+        size_t pos = 0;
+
+        void skip_whitespace() {
+            while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) pos++;
+        }
+
+        bool read_string(std::string* out) {
+            if (pos >= text.size() || text[pos] != '"') return false;
+            pos++;
+            while (pos < text.size() && text[pos] != '"') {
+                if (text[pos] == '\\' && pos + 1 < text.size()) {
+                    // Escapes other than \" and \\ never show up in script names
+                    if (out) out->push_back(text[pos + 1]);
+                    pos += 2;
+                    continue;
+                }
+                if (out) out->push_back(text[pos]);
+                pos++;
+            }
+            if (pos >= text.size()) return false;
+            pos++;
+            return true;
+        }
+
+        bool skip_value() {
+            skip_whitespace();
+            if (pos >= text.size()) return false;
+
+            char c = text[pos];
+            if (c == '"') return read_string(nullptr);
+            if (c == '{' || c == '[') {
+                int depth = 0;
+                while (pos < text.size()) {
+                    c = text[pos];
+                    if (c == '"') {
+                        if (!read_string(nullptr)) return false;
+                        continue;
+                    }
+                    if (c == '{' || c == '[') depth++;
+                    if (c == '}' || c == ']') depth--;
+                    pos++;
+                    if (depth == 0) return true;
+                }
+                return false;
+            }
+
+            // Numbers, true, false, null
+            while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ']' &&
+                   !std::isspace(static_cast<unsigned char>(text[pos]))) {
+                pos++;
+            }
+            return true;
+        }
+
+        // Iterate over "key": value pairs of the object at pos
+        template <typename Visitor>
+        bool for_each_member(Visitor visit) {
+            skip_whitespace();
+            if (pos >= text.size() || text[pos] != '{') return false;
+            pos++;
+
+            while (true) {
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == '}') {
+                    pos++;
+                    return true;
+                }
+
+                std::string key;
+                if (!read_string(&key)) return false;
+                skip_whitespace();
+                if (pos >= text.size() || text[pos] != ':') return false;
+                pos++;
+                skip_whitespace();
+
+                if (!visit(key)) return false;
+
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == ',') pos++;
+            }
+        }
+
+    public:
+        explicit Scanner(std::string_view t) : text(t) {}
+
+        // Keys of the object stored under member in the top-level object
+        std::vector<std::string> member_keys(std::string_view member) {
+            std::vector<std::string> keys;
+            pos = 0;
+            for_each_member([&](const std::string& key) {
+                if (key != member || pos >= text.size() || text[pos] != '{') {
+                    return skip_value();
+                }
+                return for_each_member([&](const std::string& inner) {
+                    keys.push_back(inner);
+                    return skip_value();
+                });
+            });
+            return keys;
+        }
+    };
+}
+
+// Per-project task runner index: npm scripts, make targets and cargo binaries
+namespace project {
+    // Walk up from the working directory looking for filename
+    std::string find_upwards(const std::string& filename) {
+        std::string dir = utils::current_dir();
+        while (true) {
+            std::string candidate = (dir == "/" ? "" : dir) + "/" + filename;
+            if (utils::file_exists(candidate)) return candidate;
+            if (dir == "/" || dir.empty()) return "";
+            dir = utils::dirname(dir);
+        }
+    }
+
+    std::vector<std::string> npm_scripts() {
+        std::string manifest = find_upwards("package.json");
+        if (manifest.empty()) return {};
+
+        return cache::cached_names("npm", manifest, [&]() {
+            cache::NameList list;
+            list.sources.push_back(cache::stamp_of(manifest));
+            list.names = json::Scanner(utils::read_file(manifest)).member_keys("scripts");
+            return list;
+        });
+    }
+
+    void scan_makefile(const std::string& path, cache::NameList& list, int depth) {
+        list.sources.push_back(cache::stamp_of(path));
+        if (depth > 8) return;
+
+        std::ifstream file(path);
+        std::string line;
+        std::string logical;
+        bool in_define = false;
+
+        while (std::getline(file, line)) {
+            // Join backslash-continued lines
+            if (!line.empty() && line.back() == '\\') {
+                logical += line.substr(0, line.size() - 1) + " ";
+                continue;
+            }
+            logical += line;
+            std::string text = logical;
+            logical.clear();
+
+            // Recipes never declare targets
+            if (text.empty() || text[0] == '\t') continue;
+
+            size_t hash = text.find('#');
+            if (hash != std::string::npos) text = text.substr(0, hash);
+
+            auto words = utils::split(text);
+            if (words.empty()) continue;
+
+            if (words[0] == "define") { in_define = true; continue; }
+            if (words[0] == "endef") { in_define = false; continue; }
+            if (in_define) continue;
+
+            if (words[0] == "include" || words[0] == "-include" || words[0] == "sinclude") {
+                for (size_t i = 1; i < words.size(); i++) {
+                    // Variable references would need a make evaluator
+                    if (utils::contains(words[i], "$")) continue;
+                    std::string included = words[i][0] == '/' ? words[i] : utils::dirname(path) + "/" + words[i];
+                    scan_makefile(included, list, depth + 1);
+                }
+                continue;
+            }
+
+            size_t colon = text.find(':');
+            if (colon == std::string::npos) continue;
+            // Skip assignments: VAR := x, VAR ::= x, VAR :::= x, VAR = a:b
+            size_t after = text.find_first_not_of(':', colon);
+            if (after != std::string::npos && text[after] == '=') continue;
+            if (text.substr(0, colon).find('=') != std::string::npos) continue;
+
+            for (const auto& target : utils::split(text.substr(0, colon))) {
+                // Special targets (.PHONY), pattern rules and computed names
+                if (target[0] == '.' || utils::contains(target, "%") || utils::contains(target, "$")) continue;
+                if (std::find(list.names.begin(), list.names.end(), target) == list.names.end()) {
+                    list.names.push_back(target);
+                }
+            }
+        }
+    }
+
+    // make only reads the makefile of the directory it runs in, so unlike
+    // npm and cargo there is no walking up here
+    std::vector<std::string> make_targets(std::string dir) {
+        // Cache keys and stamps need absolute paths
+        if (dir.empty() || dir == ".") {
+            dir = utils::current_dir();
+        } else if (dir[0] != '/') {
+            dir = utils::current_dir() + "/" + dir;
+        }
+
+        std::string makefile;
+        for (const char* name : {"GNUmakefile", "makefile", "Makefile"}) {
+            std::string candidate = dir + "/" + name;
+            if (utils::file_exists(candidate)) {
+                makefile = candidate;
+                break;
+            }
+        }
+        if (makefile.empty()) return {};
+
+        return cache::cached_names("make", makefile, [&]() {
+            cache::NameList list;
+            scan_makefile(makefile, list, 0);
+            return list;
+        });
+    }
+
+    std::string unquote(std::string value) {
+        size_t start = value.find_first_of("\"'");
+        size_t end = value.find_last_of("\"'");
+        if (start == std::string::npos || end <= start) return "";
+        return value.substr(start + 1, end - start - 1);
+    }
+
+    std::vector<std::string> cargo_bins() {
+        std::string manifest = find_upwards("Cargo.toml");
+        if (manifest.empty()) return {};
+
+        return cache::cached_names("cargo", manifest, [&]() {
+            cache::NameList list;
+            std::string root = utils::dirname(manifest);
+            list.sources.push_back(cache::stamp_of(manifest));
+            list.sources.push_back(cache::stamp_of(root + "/src/main.rs"));
+            list.sources.push_back(cache::stamp_of(root + "/src/bin"));
+
+            std::ifstream file(manifest);
+            std::string line;
+            std::string table;
+            std::string package_name;
+
+            while (std::getline(file, line)) {
+                size_t start = line.find_first_not_of(" \t");
+                if (start == std::string::npos || line[start] == '#') continue;
+                line = line.substr(start);
+
+                if (line[0] == '[') {
+                    table = line.substr(0, line.find(']') + 1);
+                    if (utils::starts_with(line, "[[")) table += "]";
+                    continue;
+                }
+                if (!utils::starts_with(line, "name")) continue;
+
+                size_t eq = line.find('=');
+                if (eq == std::string::npos || line.substr(4, eq - 4).find_first_not_of(" \t") != std::string::npos) continue;
+                std::string name = unquote(line.substr(eq + 1));
+                if (name.empty()) continue;
+
+                if (table == "[[bin]]") {
+                    list.names.push_back(name);
+                } else if (table == "[package]") {
+                    package_name = name;
+                }
+            }
+
+            // Implicit targets: src/main.rs and src/bin/*.rs
+            if (!package_name.empty() && utils::file_exists(root + "/src/main.rs")) {
+                list.names.push_back(package_name);
+            }
+            if (DIR* dir = opendir((root + "/src/bin").c_str())) {
+                while (struct dirent* entry = readdir(dir)) {
+                    std::string name = entry->d_name;
+                    if (name[0] == '.') continue;
+                    if (utils::ends_with(name, ".rs")) {
+                        list.names.push_back(name.substr(0, name.size() - 3));
+                    } else if (utils::file_exists(root + "/src/bin/" + name + "/main.rs")) {
+                        list.names.push_back(name);
+                    }
+                }
+                closedir(dir);
+            }
+            return list;
+        });
+    }
+
+    // Replace the argument typo in cmd with each of the closest names
+    std::vector<std::string> fix_argument(const Command& cmd, const std::string& typo,
+                                          const std::vector<std::string>& names) {
+        auto it = std::find(cmd.script_parts.begin(), cmd.script_parts.end(), typo);
+        if (it == cmd.script_parts.end()) return {};
+
+        std::vector<std::string> suggestions;
+        for (const auto& match : fuzzy::closest_matches(typo, names)) {
+            auto parts = cmd.script_parts;
+            parts[it - cmd.script_parts.begin()] = match.command;
+            suggestions.push_back(utils::join(parts));
+        }
+        return suggestions;
+    }
+
+    // Text between open and close following marker in output
+    std::string extract_quoted(std::string_view output, std::string_view marker,
+                               std::string_view open, std::string_view close) {
+        size_t pos = output.find(marker);
+        if (pos == std::string_view::npos) return "";
+        pos = output.find_first_of(open, pos + marker.size());
+        if (pos == std::string_view::npos) return "";
+        size_t end = output.find_first_of(close, pos + 1);
+        if (end == std::string_view::npos) return "";
+        return std::string(output.substr(pos + 1, end - pos - 1));
+    }
+}
+
+RULE_CLASS(NpmMissingScriptRule);
+bool NpmMissingScriptRule::match(const Command& cmd) const {
+    return (utils::starts_with(cmd.script, "npm ") ||
+            utils::starts_with(cmd.script, "yarn ") ||
+            utils::starts_with(cmd.script, "pnpm ")) &&
+           (utils::contains(cmd.output, "Missing script") ||
+            utils::contains(cmd.output, "error Command \""));
+}
+std::vector<std::string> NpmMissingScriptRule::get_new_command(const Command& cmd) const {
+    // npm: Missing script: "tset", pnpm: Missing script: tset, yarn: error Command "tset" not found.
+    std::string typo = project::extract_quoted(cmd.output, "Command ", "\"", "\"");
+    if (typo.empty()) {
+        size_t pos = cmd.output.find("Missing script:");
+        if (pos != std::string::npos) {
+            auto words = utils::split(std::string(cmd.output.substr(pos + 15, cmd.output.find('\n', pos) - pos - 15)));
+            if (!words.empty()) typo = words[0];
+        }
+    }
+    typo.erase(std::remove(typo.begin(), typo.end(), '"'), typo.end());
+    if (typo.empty()) return {};
+
+    return project::fix_argument(cmd, typo, project::npm_scripts());
+}
+
+RULE_CLASS(MakeNoRuleRule);
+bool MakeNoRuleRule::match(const Command& cmd) const {
+    // Not makepkg or makeinfo
+    return !cmd.script_parts.empty() &&
+           (cmd.script_parts[0] == "make" || utils::ends_with(cmd.script_parts[0], "/make")) &&
+           utils::contains(cmd.output, "No rule to make target");
+}
+std::vector<std::string> MakeNoRuleRule::get_new_command(const Command& cmd) const {
+    // GNU make quotes with 'target' (older releases use `target')
+    std::string typo = project::extract_quoted(cmd.output, "No rule to make target", "'`", "'");
+    if (typo.empty()) return {};
+
+    std::string dir = ".";
+    for (size_t i = 1; i + 1 < cmd.script_parts.size(); i++) {
+        if (cmd.script_parts[i] == "-C") dir = cmd.script_parts[i + 1];
+    }
+    return project::fix_argument(cmd, typo, project::make_targets(dir));
+}
+
+RULE_CLASS(CargoNoBinRule);
+bool CargoNoBinRule::match(const Command& cmd) const {
+    return utils::starts_with(cmd.script, "cargo ") &&
+           utils::contains(cmd.output, "no bin target named");
+}
+std::vector<std::string> CargoNoBinRule::get_new_command(const Command& cmd) const {
+    std::string typo = project::extract_quoted(cmd.output, "no bin target named", "`", "`");
+    if (typo.empty()) return {};
+
+    return project::fix_argument(cmd, typo, project::cargo_bins());
+}
+
+// LZ4 frame decoding, enough to stream the .lz4 lists apt and apt-file keep
+namespace lz4 {
+    // Decode one LZ4 block, appending to out. Matches may reach back into
+    // data already in out, which is how linked blocks share their window.
+    bool decode_block(const unsigned char* src, size_t size, std::string& out) {
+        size_t ip = 0;
+        while (ip < size) {
+            unsigned token = src[ip++];
+
+            size_t literals = token >> 4;
+            if (literals == 15) {
+                unsigned char b;
+                do {
+                    if (ip >= size) return false;
+                    b = src[ip++];
+                    literals += b;
+                } while (b == 255);
+            }
+            if (ip + literals > size) return false;
+            out.append(reinterpret_cast<const char*>(src + ip), literals);
+            ip += literals;
+
+            // The last sequence carries literals only
+            if (ip >= size) break;
+
+            if (ip + 2 > size) return false;
+            size_t offset = src[ip] | (src[ip + 1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > out.size()) return false;
+
+            size_t length = token & 15;
+            if (length == 15) {
+                unsigned char b;
+                do {
+                    if (ip >= size) return false;
+                    b = src[ip++];
+                    length += b;
+                } while (b == 255);
+            }
+            length += 4;
+
+            // Byte-wise copy: source and destination may overlap
+            size_t from = out.size() - offset;
+            for (size_t i = 0; i < length; i++) out.push_back(out[from + i]);
+        }
+        return true;
+    }
+
+    // Decode every frame in data, handing each decompressed block to sink
+    template <typename Sink>
+    bool decode_frames(std::string_view data, Sink sink) {
+        const auto* p = reinterpret_cast<const unsigned char*>(data.data());
+        size_t size = data.size();
+        size_t pos = 0;
+        std::string window;
+
+        while (pos + 4 <= size) {
+            uint32_t magic = cache::load<uint32_t>(data.data() + pos);
+            pos += 4;
+
+            // Skippable frames
+            if ((magic & 0xFFFFFFF0u) == 0x184D2A50u) {
+                if (pos + 4 > size) return false;
+                pos += 4 + cache::load<uint32_t>(data.data() + pos);
+                continue;
+            }
+            if (magic != 0x184D2204u || pos + 2 > size) return false;
+
+            unsigned flags = p[pos];
+            pos += 2; // FLG, BD
+            if ((flags >> 6) != 1) return false;
+            bool block_checksum = flags & 0x10;
+            bool content_checksum = flags & 0x04;
+            if (flags & 0x08) pos += 8; // content size
+            if (flags & 0x01) pos += 4; // dictionary id
+            pos += 1;                   // header checksum
+
+            window.clear();
+            while (true) {
+                if (pos + 4 > size) return false;
+                uint32_t block_size = cache::load<uint32_t>(data.data() + pos);
+                pos += 4;
+                if (block_size == 0) break;
+
+                bool stored = block_size & 0x80000000u;
+                block_size &= 0x7FFFFFFFu;
+                if (pos + block_size > size) return false;
+
+                size_t start = window.size();
+                if (stored) {
+                    window.append(data.data() + pos, block_size);
+                } else if (!decode_block(p + pos, block_size, window)) {
+                    return false;
+                }
+                pos += block_size + (block_checksum ? 4 : 0);
+
+                sink(std::string_view(window).substr(start));
+
+                // Keep the 64 KiB history later blocks may reference
+                if (window.size() > 65536) window.erase(0, window.size() - 65536);
+            }
+            if (content_checksum) pos += 4;
+        }
+        return true;
+    }
+}
+
+namespace stream {
+    // Call visit(line) for every line of a plain or .lz4 file. Data is
+    // processed in bounded chunks, so large package lists are never held in
+    // memory as a whole.
+    template <typename Visitor>
+    bool for_each_line(const std::string& path, Visitor visit) {
+        std::string carry;
+        auto consume = [&](std::string_view chunk) {
+            while (!chunk.empty()) {
+                size_t newline = chunk.find('\n');
+                if (newline == std::string_view::npos) {
+                    carry.append(chunk);
+                    return;
+                }
+                if (carry.empty()) {
+                    visit(chunk.substr(0, newline));
+                } else {
+                    carry.append(chunk.substr(0, newline));
+                    visit(std::string_view(carry));
+                    carry.clear();
+                }
+                chunk.remove_prefix(newline + 1);
+            }
+        };
+
+        bool ok = true;
+        if (utils::ends_with(path, ".lz4")) {
+            cache::MappedFile file(path);
+            if (!file.valid()) return false;
+            ok = lz4::decode_frames(file.data(), consume);
+        } else {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            std::vector<char> buffer(1 << 20);
+            ssize_t n;
+            while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+                consume(std::string_view(buffer.data(), n));
+            }
+            close(fd);
+        }
+        if (!carry.empty()) visit(std::string_view(carry));
+        return ok;
+    }
+
+    // Names of the entries in a directory, without . and ..
+    std::vector<std::string> list_dir(const std::string& path) {
+        std::vector<std::string> names;
+        DIR* dir = opendir(path.c_str());
+        if (!dir) return names;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..") names.push_back(name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+}
+
+// Which package provides a command or shared library, from local package
+// manager metadata
+namespace packages {
+    const char* const BIN_DIRS[] = {
+        "bin/", "sbin/", "usr/bin/", "usr/sbin/", "usr/games/", "usr/local/bin/", "usr/local/sbin/"
+    };
+
+    // "usr/bin/vim" -> "vim" when path sits directly in a bin directory
+    std::string_view binary_name(std::string_view path) {
+        if (!path.empty() && path[0] == '/') path.remove_prefix(1);
+        for (const char* dir : BIN_DIRS) {
+            std::string_view prefix(dir);
+            if (path.size() > prefix.size() && path.substr(0, prefix.size()) == prefix &&
+                path.find('/', prefix.size()) == std::string_view::npos) {
+                return path.substr(prefix.size());
+            }
+        }
+        return {};
+    }
+
+    // "usr/lib/x86_64-linux-gnu/libssl.so.3" -> "libssl.so.3" for shared
+    // libraries in the standard (and multiarch) library directories
+    std::string_view library_name(std::string_view path) {
+        if (!path.empty() && path[0] == '/') path.remove_prefix(1);
+        size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos) return {};
+        std::string_view dir = path.substr(0, slash);
+        std::string_view name = path.substr(slash + 1);
+        if (name.substr(0, 3) != "lib" || name.find(".so") == std::string_view::npos) return {};
+
+        for (std::string_view base : {"lib", "lib64", "usr/lib", "usr/lib64", "usr/local/lib"}) {
+            if (dir == base) return name;
+            if (dir.size() > base.size() && dir.substr(0, base.size()) == base && dir[base.size()] == '/' &&
+                dir.find('/', base.size() + 1) == std::string_view::npos &&
+                dir.find("-linux-") != std::string_view::npos) {
+                return name;
+            }
+        }
+        return {};
+    }
+
+    // Names worth indexing: commands and shared libraries
+    std::string_view indexed_name(std::string_view path) {
+        auto name = binary_name(path);
+        return name.empty() ? library_name(path) : name;
+    }
+
+    // Metadata whose change means packages were installed, removed or
+    // their lists updated
+    std::vector<std::string> database_paths() {
+        return {"/var/lib/dpkg/info", "/var/lib/dpkg/status", "/var/lib/apt/lists", "/var/lib/pacman/local"};
+    }
+
+    // Who provides a file: an installed package (with the file's path) or
+    // one from the apt Contents lists
+    struct Provider {
+        bool installed = false;
+        std::string package;
+        std::string path;
+    };
+
+    // Records are "installed\0<package>\0<path>" and "apt\0<package>": NUL
+    // is the one byte paths can't contain
+    std::string installed_record(std::string_view package, std::string_view path) {
+        std::string record = "installed";
+        record += '\0';
+        record += package;
+        record += '\0';
+        record += path;
+        return record;
+    }
+
+    std::string apt_record(std::string_view package) {
+        std::string record = "apt";
+        record += '\0';
+        record += package;
+        return record;
+    }
+
+    std::optional<Provider> parse_record(std::string_view record) {
+        size_t first = record.find('\0');
+        if (first == std::string_view::npos) return std::nullopt;
+        std::string_view kind = record.substr(0, first);
+        std::string_view rest = record.substr(first + 1);
+        Provider provider;
+        if (kind == "apt" && !rest.empty() && rest.find('\0') == std::string_view::npos) {
+            provider.package = rest;
+            return provider;
+        }
+        size_t second = rest.find('\0');
+        if (kind != "installed" || second == std::string_view::npos) return std::nullopt;
+        provider.installed = true;
+        provider.package = rest.substr(0, second);
+        provider.path = rest.substr(second + 1);
+        return provider;
+    }
+
+    void add_dpkg(cache::HashMapBuilder& index) {
+        const std::string info = "/var/lib/dpkg/info/";
+        auto names = stream::list_dir(info);
+        std::set<std::string> listed;
+
+        for (const auto& name : names) {
+            if (!utils::ends_with(name, ".list")) continue;
+            std::string package = name.substr(0, name.size() - 5);
+            listed.insert(package);
+            package = package.substr(0, package.find(':'));
+            stream::for_each_line(info + name, [&](std::string_view line) {
+                auto indexed = indexed_name(line);
+                if (!indexed.empty()) index.add(std::string(indexed), installed_record(package, line));
+            });
+        }
+
+        // md5sums only matter for packages whose .list is gone
+        for (const auto& name : names) {
+            if (!utils::ends_with(name, ".md5sums")) continue;
+            std::string package = name.substr(0, name.size() - 8);
+            if (listed.count(package)) continue;
+            package = package.substr(0, package.find(':'));
+            stream::for_each_line(info + name, [&](std::string_view line) {
+                size_t space = line.find("  ");
+                if (space == std::string_view::npos) return;
+                auto path = line.substr(space + 2);
+                auto indexed = indexed_name(path);
+                if (!indexed.empty()) index.add(std::string(indexed), installed_record(package, "/" + std::string(path)));
+            });
+        }
+    }
+
+    void add_apt_contents(cache::HashMapBuilder& index) {
+        const std::string lists = "/var/lib/apt/lists/";
+        for (const auto& name : stream::list_dir(lists)) {
+            size_t contents = name.find("Contents-");
+            if (contents == std::string::npos) continue;
+            // .gz and .xz would need another decompressor
+            if (name.find('.', contents) != std::string::npos && !utils::ends_with(name, ".lz4")) continue;
+
+            // "usr/bin/vim.basic     editors/vim,editors/vim-tiny"
+            stream::for_each_line(lists + name, [&](std::string_view line) {
+                size_t split = line.find_last_of(" \t");
+                if (split == std::string_view::npos) return;
+                size_t path_end = line.find_last_not_of(" \t", split);
+                if (path_end == std::string_view::npos) return;
+
+                auto indexed = indexed_name(line.substr(0, path_end + 1));
+                if (indexed.empty()) return;
+
+                std::string_view owners = line.substr(split + 1);
+                while (!owners.empty()) {
+                    size_t comma = owners.find(',');
+                    auto owner = owners.substr(0, comma);
+                    size_t slash = owner.rfind('/');
+                    if (slash != std::string_view::npos) owner.remove_prefix(slash + 1);
+                    if (!owner.empty()) index.add(std::string(indexed), apt_record(owner));
+                    if (comma == std::string_view::npos) break;
+                    owners.remove_prefix(comma + 1);
+                }
+            });
+        }
+    }
+
+    void add_pacman(cache::HashMapBuilder& index) {
+        const std::string local = "/var/lib/pacman/local/";
+        for (const auto& entry : stream::list_dir(local)) {
+            std::string package;
+            bool in_name = false;
+            stream::for_each_line(local + entry + "/desc", [&](std::string_view line) {
+                if (in_name && package.empty()) package = line;
+                in_name = line == "%NAME%";
+            });
+            if (package.empty()) continue;
+
+            bool in_files = false;
+            stream::for_each_line(local + entry + "/files", [&](std::string_view line) {
+                if (line.empty() || line[0] == '%') {
+                    in_files = line == "%FILES%";
+                    return;
+                }
+                if (!in_files) return;
+                auto indexed = indexed_name(line);
+                if (!indexed.empty()) index.add(std::string(indexed), installed_record(package, "/" + std::string(line)));
+            });
+        }
+    }
+
+    const cache::HashMapView& file_index() {
+        static std::unique_ptr<cache::IndexReader> reader;
+        static cache::HashMapView view;
+        if (!reader) {
+            // Layout revision folded in: libraries were added in v2, NUL
+            // separated records in v3
+            uint64_t stamp = utils::fnv1a("v3", cache::combined_stamp(database_paths()));
+            reader = cache::open_index("packages.idx", stamp, [](cache::IndexWriter& writer) {
+                cache::HashMapBuilder index;
+                add_dpkg(index);
+                add_apt_contents(index);
+                add_pacman(index);
+                writer.add_section(cache::section_id("BINS"), index.serialize());
+            }, true);
+            view = cache::HashMapView(reader->section(cache::section_id("BINS")));
+        }
+        return view;
+    }
+
+    std::vector<Provider> providers(const std::string& binary) {
+        auto found = file_index().find(binary);
+        if (!found) return {};
+        std::vector<Provider> result;
+        for (const auto& record : utils::split(std::string(*found), '\n')) {
+            if (auto provider = parse_record(record)) result.push_back(std::move(*provider));
+        }
+        return result;
+    }
+}
+
+// Suggest installing the package that provides a missing command, or the
+// full path when it is installed outside of PATH
+class CommandNotFoundPackageRule : public Rule {
+public:
+    std::string get_name() const override { return "CommandNotFoundPackageRule"; }
+    // Ahead of the fuzzy rules: an exact provider beats a near-miss command
+    int get_priority() const override { return 900; }
+    bool match(const Command& cmd) const override;
+    std::vector<std::string> get_new_command(const Command& cmd) const override;
+};
+bool CommandNotFoundPackageRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "command not found") &&
+           !cmd.script_parts.empty() &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> CommandNotFoundPackageRule::get_new_command(const Command& cmd) const {
+    std::vector<std::string> suggestions;
+    for (const auto& provider : packages::providers(cmd.script_parts[0])) {
+        std::string fixed;
+        if (provider.installed) {
+            if (access(provider.path.c_str(), X_OK) != 0) continue;
+            auto parts = cmd.script_parts;
+            parts[0] = utils::shell_quote(provider.path);
+            fixed = utils::join(parts);
+        } else {
+            fixed = "sudo apt install " + provider.package + " && " + cmd.script;
+        }
+        if (std::find(suggestions.begin(), suggestions.end(), fixed) == suggestions.end()) {
+            suggestions.push_back(fixed);
+        }
+        if (suggestions.size() >= 3) break;
+    }
+    return suggestions;
+}
+
+// Package names known to apt/dpkg/pacman, for correcting install typos.
+// The vocabulary runs to ~100k names, so instead of scanning it all the
+// index keeps names sorted by length plus trigram posting lists.
+namespace package_names {
+    constexpr uint32_t POOL = cache::section_id("NPOL");
+    constexpr uint32_t OFFSETS = cache::section_id("NOFF");
+    constexpr uint32_t LENGTHS = cache::section_id("NLEN");
+    constexpr uint32_t TRIGRAMS = cache::section_id("TGRM");
+    constexpr uint32_t POSTINGS = cache::section_id("POST");
+    constexpr size_t MAX_LENGTH = 128;
+
+    struct TrigramEntry {
+        uint32_t trigram;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // Distinct trigrams of the word padded with two sentinels on each side
+    std::vector<uint32_t> trigrams(std::string_view word) {
+        std::string padded = "\x01\x01" + std::string(word) + "\x02\x02";
+        std::vector<uint32_t> result;
+        for (size_t i = 0; i + 3 <= padded.size(); i++) {
+            result.push_back(static_cast<unsigned char>(padded[i]) << 16 |
+                             static_cast<unsigned char>(padded[i + 1]) << 8 |
+                             static_cast<unsigned char>(padded[i + 2]));
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    void collect(std::set<std::string>& names) {
+        // "Package: vim" stanzas in apt lists and the dpkg status file
+        auto add_stanzas = [&](const std::string& path) {
+            stream::for_each_line(path, [&](std::string_view line) {
+                if (line.size() > 9 && line.substr(0, 9) == "Package: ") {
+                    names.emplace(line.substr(9));
+                }
+            });
+        };
+
+        const std::string lists = "/var/lib/apt/lists/";
+        for (const auto& name : stream::list_dir(lists)) {
+            if (utils::ends_with(name, "_Packages") || utils::ends_with(name, "_Packages.lz4")) {
+                add_stanzas(lists + name);
+            }
+        }
+        add_stanzas("/var/lib/dpkg/status");
+
+        // pacman's local db: one "<name>-<version>-<release>" directory per package
+        for (const auto& entry : stream::list_dir("/var/lib/pacman/local")) {
+            size_t release = entry.rfind('-');
+            if (release == std::string::npos || release == 0) continue;
+            size_t version = entry.rfind('-', release - 1);
+            if (version != std::string::npos && version > 0) names.insert(entry.substr(0, version));
+        }
+    }
+
+    void build(cache::IndexWriter& writer) {
+        std::set<std::string> unique;
+        collect(unique);
+
+        // Names are bucketed by length below, every source is capped here
+        std::vector<std::string> names;
+        for (const auto& name : unique) {
+            if (name.size() < MAX_LENGTH) names.push_back(name);
+        }
+        std::stable_sort(names.begin(), names.end(), [](const auto& a, const auto& b) {
+            return a.size() < b.size();
+        });
+
+        std::string pool, offsets, lengths;
+        std::vector<std::pair<uint32_t, uint32_t>> pairs; // (trigram, name id)
+        std::vector<uint32_t> first_of_length(MAX_LENGTH + 2, static_cast<uint32_t>(names.size()));
+
+        for (uint32_t id = 0; id < names.size(); id++) {
+            const auto& name = names[id];
+            first_of_length[name.size()] = std::min(first_of_length[name.size()], id);
+            cache::store(offsets, static_cast<uint32_t>(pool.size()));
+            pool += name;
+            for (uint32_t t : trigrams(name)) pairs.emplace_back(t, id);
+        }
+        cache::store(offsets, static_cast<uint32_t>(pool.size()));
+
+        // Make first_of_length monotonic so [first[n], first[n + 1]) is the
+        // id range of names of length n
+        for (size_t n = MAX_LENGTH + 1; n-- > 0;) {
+            first_of_length[n] = std::min(first_of_length[n], first_of_length[n + 1]);
+        }
+        for (uint32_t first : first_of_length) cache::store(lengths, first);
+
+        std::sort(pairs.begin(), pairs.end());
+        std::string table, postings;
+        for (size_t i = 0; i < pairs.size();) {
+            TrigramEntry entry{pairs[i].first, static_cast<uint32_t>(i), 0};
+            while (i < pairs.size() && pairs[i].first == entry.trigram) {
+                cache::store(postings, pairs[i].second);
+                i++;
+            }
+            entry.count = static_cast<uint32_t>(i) - entry.first;
+            cache::store(table, entry);
+        }
+
+        writer.add_section(POOL, std::move(pool));
+        writer.add_section(OFFSETS, std::move(offsets));
+        writer.add_section(LENGTHS, std::move(lengths));
+        writer.add_section(TRIGRAMS, std::move(table));
+        writer.add_section(POSTINGS, std::move(postings));
+    }
+
+    class NameIndex {
+    private:
+        std::unique_ptr<cache::IndexReader> reader;
+        std::string_view pool, offsets, lengths, table, postings;
+
+        uint32_t u32(std::string_view section, size_t i) const {
+            return cache::load<uint32_t>(section.data() + i * 4);
+        }
+
+        uint32_t first_of_length(size_t n) const {
+            return u32(lengths, std::min(n, MAX_LENGTH + 1));
+        }
+
+        // Postings of one trigram, as a range of name ids in ascending order
+        std::pair<const char*, size_t> postings_of(uint32_t trigram) const {
+            size_t lo = 0, hi = table.size() / sizeof(TrigramEntry);
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                auto entry = cache::load<TrigramEntry>(table.data() + mid * sizeof(TrigramEntry));
+                if (entry.trigram < trigram) {
+                    lo = mid + 1;
+                } else if (entry.trigram > trigram) {
+                    hi = mid;
+                } else {
+                    return {postings.data() + entry.first * 4, entry.count};
+                }
+            }
+            return {nullptr, 0};
+        }
+
+    public:
+        NameIndex() {
+            reader = cache::open_index("package-names.idx", cache::combined_stamp(packages::database_paths()), build, true);
+            pool = reader->section(POOL);
+            offsets = reader->section(OFFSETS);
+            lengths = reader->section(LENGTHS);
+            table = reader->section(TRIGRAMS);
+            postings = reader->section(POSTINGS);
+            if (lengths.size() != (MAX_LENGTH + 2) * 4 || offsets.size() < 4) {
+                offsets = lengths = {};
+            }
+        }
+
+        size_t size() const { return offsets.empty() ? 0 : offsets.size() / 4 - 1; }
+
+        std::string_view name(uint32_t id) const {
+            uint32_t begin = u32(offsets, id), end = u32(offsets, id + 1);
+            if (end < begin || end > pool.size()) return {};
+            return pool.substr(begin, end - begin);
+        }
+
+        std::vector<fuzzy::CommandMatch> closest(std::string_view word) const {
+            std::vector<fuzzy::CommandMatch> matches;
+            if (size() == 0 || word.empty() || word.size() > MAX_LENGTH) return matches;
+
+            int max_distance = fuzzy::max_distance_for(word);
+            uint32_t lo = first_of_length(word.size() > static_cast<size_t>(max_distance) ? word.size() - max_distance : 0);
+            uint32_t hi = first_of_length(word.size() + max_distance + 1);
+
+            auto consider = [&](uint32_t id) {
+                std::string_view candidate = name(id);
+                if (candidate == word) return;
+                int dist = fuzzy::osa_distance(word, candidate, max_distance);
+                if (dist <= max_distance) matches.push_back({std::string(candidate), dist});
+            };
+
+            // An OSA edit touches at most four padded trigrams, so a match
+            // keeps at least this many of the word's trigrams
+            auto grams = trigrams(word);
+            int needed = static_cast<int>(grams.size()) - 4 * max_distance;
+
+            if (needed <= 0) {
+                // Too short for the filter; the length window is small anyway
+                for (uint32_t id = lo; id < hi; id++) consider(id);
+            } else {
+                std::vector<uint8_t> hits(hi - lo, 0);
+                for (uint32_t t : grams) {
+                    auto [data, count] = postings_of(t);
+                    // Postings are sorted by id, and ids are sorted by length
+                    size_t begin = 0, end = count;
+                    while (begin < end) {
+                        size_t mid = (begin + end) / 2;
+                        if (cache::load<uint32_t>(data + mid * 4) < lo) begin = mid + 1; else end = mid;
+                    }
+                    for (size_t i = begin; i < count; i++) {
+                        uint32_t id = cache::load<uint32_t>(data + i * 4);
+                        if (id >= hi) break;
+                        if (hits[id - lo] < 255) hits[id - lo]++;
+                    }
+                }
+                for (uint32_t id = lo; id < hi; id++) {
+                    if (hits[id - lo] >= needed) consider(id);
+                }
+            }
+
+            std::stable_sort(matches.begin(), matches.end(), fuzzy::compare_matches);
+            if (matches.size() > 3) matches.resize(3);
+            return matches;
+        }
+    };
+
+    const NameIndex& index() {
+        static NameIndex names;
+        return names;
+    }
+
+    // The package name apt or pacman complained about, if any. dnf's "No
+    // match for argument" is left alone: its repo metadata isn't indexed,
+    // and the apt and pacman names above don't exist on a dnf system.
+    std::string unknown_package(std::string_view output) {
+        for (const char* marker : {"Unable to locate package ", "target not found: "}) {
+            size_t pos = output.find(marker);
+            if (pos == std::string_view::npos) continue;
+            pos += std::strlen(marker);
+            size_t end = output.find_first_of(" \r\n", pos);
+            return std::string(output.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+        }
+        return "";
+    }
+}
+
+RULE_CLASS(UnknownPackageRule);
+bool UnknownPackageRule::match(const Command& cmd) const {
+    return !package_names::unknown_package(cmd.output).empty() &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> UnknownPackageRule::get_new_command(const Command& cmd) const {
+    std::string package = package_names::unknown_package(cmd.output);
+    auto it = std::find(cmd.script_parts.begin(), cmd.script_parts.end(), package);
+    if (it == cmd.script_parts.end()) return {};
+
+    std::vector<std::string> suggestions;
+    for (const auto& match : package_names::index().closest(package)) {
+        auto parts = cmd.script_parts;
+        parts[it - cmd.script_parts.begin()] = match.command;
+        suggestions.push_back(utils::join(parts));
+    }
+    return suggestions;
+}
+
+// Minimal ELF reader: exported symbols from the dynamic symbol table
+namespace elf {
+    template <typename Ehdr, typename Shdr, typename Sym, typename Visitor>
+    bool walk_dynsym(std::string_view image, Visitor& visit) {
+        if (image.size() < sizeof(Ehdr)) return false;
+        auto header = cache::load<Ehdr>(image.data());
+        if (header.e_shentsize != sizeof(Shdr) ||
+            header.e_shoff + static_cast<uint64_t>(header.e_shnum) * sizeof(Shdr) > image.size()) {
+            return false;
+        }
+
+        auto section = [&](size_t i) {
+            return cache::load<Shdr>(image.data() + header.e_shoff + i * sizeof(Shdr));
+        };
+
+        for (size_t i = 0; i < header.e_shnum; i++) {
+            Shdr symtab = section(i);
+            if (symtab.sh_type != SHT_DYNSYM || symtab.sh_link >= header.e_shnum) continue;
+            Shdr strtab = section(symtab.sh_link);
+            if (symtab.sh_offset + symtab.sh_size > image.size() ||
+                strtab.sh_offset + strtab.sh_size > image.size()) {
+                return false;
+            }
+
+            std::string_view names = image.substr(strtab.sh_offset, strtab.sh_size);
+            for (size_t j = 1; j < symtab.sh_size / sizeof(Sym); j++) {
+                auto symbol = cache::load<Sym>(image.data() + symtab.sh_offset + j * sizeof(Sym));
+                if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= names.size()) continue;
+
+                unsigned bind = ELF64_ST_BIND(symbol.st_info);
+                unsigned type = ELF64_ST_TYPE(symbol.st_info);
+                if (bind != STB_GLOBAL && bind != STB_WEAK) continue;
+                if (type != STT_FUNC && type != STT_OBJECT && type != STT_GNU_IFUNC && type != STT_TLS) continue;
+
+                std::string_view name = names.substr(symbol.st_name);
+                name = name.substr(0, name.find('\0'));
+                if (!name.empty()) visit(name);
+            }
+        }
+        return true;
+    }
+
+    // Visit the defined global symbols in the .dynsym of an ELF image of the
+    // host's byte order
+    template <typename Visitor>
+    bool for_each_dynamic_symbol(std::string_view image, Visitor visit) {
+        if (image.size() < EI_NIDENT || std::memcmp(image.data(), ELFMAG, SELFMAG) != 0) return false;
+
+        constexpr char host_data = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ELFDATA2LSB : ELFDATA2MSB;
+        if (image[EI_DATA] != host_data) return false;
+
+        if (image[EI_CLASS] == ELFCLASS64) return walk_dynsym<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>(image, visit);
+        if (image[EI_CLASS] == ELFCLASS32) return walk_dynsym<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>(image, visit);
+        return false;
+    }
+}
+
+// Which -l<lib> exports a symbol, from the dev symlinks (lib*.so) in the
+// standard library directories
+namespace libraries {
+    constexpr uint32_t LIBS = cache::section_id("LIBS");
+    constexpr uint32_t LIB_POOL = cache::section_id("LPOL");
+    constexpr uint32_t SYMBOLS = cache::section_id("SYMS");
+
+    constexpr uint32_t LIB_SYMBOLS = cache::section_id("LSYM");
+    // Layout revision; 2 added demangled C++ names
+    constexpr uint32_t VERSION = cache::section_id("LVER");
+    constexpr uint32_t LAYOUT = 2;
+
+    // Per-library record, kept so the next rebuild can reuse the symbols of
+    // libraries whose file did not change. Symbols are stored as entry ids
+    // of the SYMS map, first..first + count in LSYM.
+    struct LibRecord {
+        int64_t mtime;
+        int64_t size;
+        uint32_t path_offset;
+        uint32_t path_length;
+        uint32_t first_symbol;
+        uint32_t symbol_count;
+    };
+
+    std::vector<std::string> search_dirs() {
+        std::vector<std::string> candidates = {
+            "/lib", "/lib64", "/usr/lib", "/usr/lib64", "/usr/local/lib", "/usr/local/lib64"
+        };
+        // Debian-style multiarch directories
+        for (const char* base : {"/lib", "/usr/lib"}) {
+            for (const auto& name : stream::list_dir(base)) {
+                if (utils::contains(name, "-linux-")) candidates.push_back(std::string(base) + "/" + name);
+            }
+        }
+
+        // /lib is often a symlink to /usr/lib
+        std::vector<std::string> dirs;
+        std::set<std::string> seen;
+        for (const auto& dir : candidates) {
+            char resolved[PATH_MAX];
+            if (!realpath(dir.c_str(), resolved) || !utils::is_directory(resolved)) continue;
+            if (seen.insert(resolved).second) dirs.push_back(resolved);
+        }
+        return dirs;
+    }
+
+    // Member libraries named by a GNU ld script such as libc.so or libm.so:
+    // "GROUP ( /lib/x86_64-linux-gnu/libm.so.6 AS_NEEDED ( ... ) )"
+    std::vector<std::string> linker_script_members(const std::string& text, const std::string& dir) {
+        std::vector<std::string> members;
+        std::string cleaned = text;
+        for (char& c : cleaned) {
+            if (c == '(' || c == ')' || c == '\n' || c == '\t') c = ' ';
+        }
+        for (const auto& word : utils::split(cleaned)) {
+            if (!utils::contains(word, ".so")) continue;
+            members.push_back(word[0] == '/' ? word : dir + "/" + word);
+        }
+        return members;
+    }
+
+    // Exported symbols of a library, newline separated. C++ symbols are
+    // also listed demangled, the way GNU ld and lld report them.
+    std::string read_symbols(const std::string& path) {
+        std::set<std::string> symbols;
+        auto collect = [&](std::string_view name) {
+            symbols.emplace(name);
+            if (!utils::starts_with(name, "_Z")) return;
+            int status = 0;
+            std::string mangled(name);
+            char* demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+            if (status == 0 && demangled) symbols.emplace(demangled);
+            std::free(demangled);
+        };
+
+        cache::MappedFile file(path);
+        if (!elf::for_each_dynamic_symbol(file.data(), collect)) {
+            std::string_view head = file.data().substr(0, 4096);
+            if (head.find("GROUP") == std::string_view::npos && head.find("INPUT") == std::string_view::npos) {
+                return "";
+            }
+            for (const auto& member : linker_script_members(std::string(file.data()), utils::dirname(path))) {
+                cache::MappedFile image(member);
+                elf::for_each_dynamic_symbol(image.data(), collect);
+            }
+        }
+
+        std::string joined;
+        for (const auto& symbol : symbols) {
+            joined += symbol;
+            joined += '\n';
+        }
+        return joined;
+    }
+
+    std::string index_path() {
+        return cache::path_for("libsyms.idx");
+    }
+
+    void build(cache::IndexWriter& writer) {
+        // Symbols of unchanged libraries come from the previous generation
+        std::map<std::string, std::pair<LibRecord, std::vector<std::string>>> previous;
+        cache::IndexReader old(index_path());
+        std::string_view old_version = old.section(VERSION);
+        bool same_layout = old_version.size() == 4 && cache::load<uint32_t>(old_version.data()) == LAYOUT;
+        std::string_view old_libs = same_layout ? old.section(LIBS) : std::string_view();
+        std::string_view old_pool = old.section(LIB_POOL);
+        std::string_view old_ids = old.section(LIB_SYMBOLS);
+        cache::HashMapView old_symbols(old.section(SYMBOLS));
+        for (size_t i = 0; i + sizeof(LibRecord) <= old_libs.size(); i += sizeof(LibRecord)) {
+            auto record = cache::load<LibRecord>(old_libs.data() + i);
+            if (static_cast<size_t>(record.path_offset) + record.path_length > old_pool.size() ||
+                (static_cast<size_t>(record.first_symbol) + record.symbol_count) * 4 > old_ids.size()) {
+                continue;
+            }
+            std::vector<std::string> exported;
+            for (uint32_t k = 0; k < record.symbol_count; k++) {
+                uint32_t id = cache::load<uint32_t>(old_ids.data() + (record.first_symbol + k) * 4);
+                if (id < old_symbols.size()) exported.emplace_back(old_symbols.key(id));
+            }
+            previous[std::string(old_pool.substr(record.path_offset, record.path_length))] = {record, std::move(exported)};
+        }
+
+        std::vector<std::pair<std::string, std::vector<std::string>>> libs; // (path, symbols)
+        std::vector<LibRecord> records;
+        std::string pool;
+        cache::HashMapBuilder symbols;
+        std::set<std::string> seen_names;
+
+        for (const auto& dir : search_dirs()) {
+            for (const auto& file : stream::list_dir(dir)) {
+                if (!utils::starts_with(file, "lib") || !utils::ends_with(file, ".so")) continue;
+                std::string name = file.substr(3, file.size() - 6);
+                // The first directory wins, as it does for the linker
+                if (name.empty() || !seen_names.insert(name).second) continue;
+
+                std::string path = dir + "/" + file;
+                cache::Stamp stamp = cache::stamp_of(path);
+                if (stamp.mtime < 0) continue;
+
+                std::vector<std::string> exported;
+                auto old_entry = previous.find(path);
+                if (old_entry != previous.end() && old_entry->second.first.mtime == stamp.mtime &&
+                    old_entry->second.first.size == stamp.size) {
+                    exported = std::move(old_entry->second.second);
+                } else {
+                    exported = utils::split(read_symbols(path), '\n');
+                }
+
+                records.push_back({stamp.mtime, stamp.size, static_cast<uint32_t>(pool.size()),
+                                   static_cast<uint32_t>(path.size()), 0, 0});
+                pool += path;
+                for (const auto& symbol : exported) symbols.add(symbol, name);
+                libs.emplace_back(path, std::move(exported));
+            }
+        }
+
+        // Map entry ids are the ranks of the sorted keys
+        auto keys = symbols.keys();
+        std::string ids, table;
+        for (size_t i = 0; i < libs.size(); i++) {
+            records[i].first_symbol = static_cast<uint32_t>(ids.size() / 4);
+            records[i].symbol_count = static_cast<uint32_t>(libs[i].second.size());
+            for (const auto& symbol : libs[i].second) {
+                auto it = std::lower_bound(keys.begin(), keys.end(), std::string_view(symbol));
+                cache::store(ids, static_cast<uint32_t>(it - keys.begin()));
+            }
+            cache::store(table, records[i]);
+        }
+
+        std::string version;
+        cache::store(version, LAYOUT);
+        writer.add_section(VERSION, std::move(version));
+        writer.add_section(LIBS, std::move(table));
+        writer.add_section(LIB_POOL, std::move(pool));
+        writer.add_section(LIB_SYMBOLS, std::move(ids));
+        writer.add_section(SYMBOLS, symbols.serialize());
+    }
+
+    const cache::HashMapView& symbol_index() {
+        static std::unique_ptr<cache::IndexReader> reader;
+        static cache::HashMapView view;
+        if (!reader) {
+            reader = cache::open_index("libsyms.idx", utils::fnv1a("v2", cache::combined_stamp(search_dirs())), build);
+            view = cache::HashMapView(reader->section(SYMBOLS));
+        }
+        return view;
+    }
+
+    // Whether libc exports symbol. Since glibc 2.34 that includes what
+    // used to be in libpthread, libdl and librt (pthread_create, dlopen),
+    // which then needs no library at all.
+    bool in_libc(std::string_view symbol) {
+        auto found = symbol_index().find(symbol);
+        if (!found) return false;
+        auto libs = utils::split(std::string(*found), '\n');
+        return std::find(libs.begin(), libs.end(), "c") != libs.end();
+    }
+
+    // Links that leave out the C library, where -lc has to be explicit
+    bool links_without_libc(const Command& cmd) {
+        std::string tool = cmd.script_parts[0].substr(cmd.script_parts[0].rfind('/') + 1);
+        if (tool == "ld" || utils::starts_with(tool, "ld.")) return true;
+        return std::any_of(cmd.script_parts.begin(), cmd.script_parts.end(), [](const std::string& part) {
+            return part == "-nostdlib" || part == "-nodefaultlibs" || part == "-nolibc";
+        });
+    }
+
+    // Libraries exporting symbol; libc is left out since every link has it
+    std::vector<std::string> providers(std::string_view symbol) {
+        std::vector<std::string> libs;
+        auto found = symbol_index().find(symbol);
+        if (!found) return libs;
+        for (const auto& lib : utils::split(std::string(*found), '\n')) {
+            if (lib != "c") libs.push_back(lib);
+        }
+        // Short names first: -lm rather than -lmvec
+        std::stable_sort(libs.begin(), libs.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+        return libs;
+    }
+
+    // Symbols from "undefined reference to `sym'" (GNU ld) and
+    // "undefined symbol: sym" (lld) lines
+    std::vector<std::string> undefined_symbols(std::string_view output) {
+        std::vector<std::string> result;
+        auto add = [&](std::string symbol) {
+            symbol = symbol.substr(0, symbol.find('@'));
+            if (!symbol.empty() && std::find(result.begin(), result.end(), symbol) == result.end()) {
+                result.push_back(symbol);
+            }
+        };
+
+        for (const auto& line : utils::split(std::string(output), '\n')) {
+            size_t pos = line.find("undefined reference to ");
+            if (pos != std::string::npos) {
+                size_t start = line.find_first_of("`'‘", pos + 23);
+                if (start == std::string::npos) continue;
+                start = line.find_first_not_of("`'‘\x80\x98\xe2", start);
+                size_t end = line.find_first_of("'’", start);
+                if (start != std::string::npos && end != std::string::npos) add(line.substr(start, end - start));
+                continue;
+            }
+            // The rest of the line: demangled C++ names contain spaces
+            pos = line.find("undefined symbol: ");
+            if (pos != std::string::npos) {
+                std::string symbol = line.substr(pos + 18);
+                size_t end = symbol.find_last_not_of(" \t\r");
+                if (end != std::string::npos) add(symbol.substr(0, end + 1));
+            }
+        }
+        return result;
+    }
+
+    bool is_link_command(const Command& cmd) {
+        if (cmd.script_parts.empty()) return false;
+        std::string tool = cmd.script_parts[0].substr(cmd.script_parts[0].rfind('/') + 1);
+        for (const char* compiler : {"gcc", "g++", "cc", "c++", "clang", "clang++", "ld", "ld.lld", "ld.gold"}) {
+            if (tool == compiler || utils::starts_with(tool, std::string(compiler) + "-")) return true;
+        }
+        return false;
+    }
+}
+
+RULE_CLASS(LinkerMissingLibraryRule);
+bool LinkerMissingLibraryRule::match(const Command& cmd) const {
+    return libraries::is_link_command(cmd) &&
+           (utils::contains(cmd.output, "undefined reference to") ||
+            utils::contains(cmd.output, "undefined symbol:")) &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> LinkerMissingLibraryRule::get_new_command(const Command& cmd) const {
+    std::string flags;
+    for (const auto& symbol : libraries::undefined_symbols(cmd.output)) {
+        std::string flag;
+        if (libraries::in_libc(symbol)) {
+            // No library to add for a normal link; still undefined there
+            // means objects built against another glibc
+            if (libraries::links_without_libc(cmd)) {
+                flag = "-lc";
+            } else {
+                if (Settings::instance().debug) {
+                    std::cerr << symbol << " is in libc, no library needed; check the glibc you link against\n";
+                }
+                continue;
+            }
+        } else {
+            auto libs = libraries::providers(symbol);
+            if (libs.empty()) continue;
+            flag = "-l" + libs[0];
+        }
+        if (std::find(cmd.script_parts.begin(), cmd.script_parts.end(), flag) != cmd.script_parts.end()) continue;
+        if (!utils::contains(flags + " ", " " + flag + " ")) flags += " " + flag;
+    }
+    if (flags.empty()) return {};
+    return {cmd.script + flags};
+}
+
+// Header index: header file name -> directories containing it, for
+// /usr/include and /usr/local/include. Per-directory listings are kept so
+// a refresh only re-reads directories whose mtime changed.
+namespace headers {
+    constexpr uint32_t HEADERS = cache::section_id("HDRS");
+    constexpr uint32_t LISTINGS = cache::section_id("DIRS");
+
+    bool is_header(const std::string& name) {
+        for (const char* ext : {".h", ".hh", ".hpp", ".hxx", ".h++", ".inc", ".inl", ".ipp", ".tcc"}) {
+            if (utils::ends_with(name, ext)) return true;
+        }
+        return false;
+    }
+
+    std::vector<std::string> system_roots() {
+        return {"/usr/include", "/usr/local/include"};
+    }
+
+    // Directories the compiler searches without any -I
+    bool is_default_dir(const std::string& dir) {
+        if (dir == "/usr/include" || dir == "/usr/local/include") return true;
+        return utils::starts_with(dir, "/usr/include/") && utils::contains(dir, "-linux-") &&
+               dir.find('/', 13) == std::string::npos;
+    }
+
+    void add_listings(cache::HashMapBuilder& index, const std::vector<scan::Directory>& dirs) {
+        for (const auto& dir : dirs) {
+            for (const auto& file : dir.files) {
+                if (is_header(file)) index.add(file, dir.path);
+            }
+        }
+    }
+
+    // Listings are stored as text: "D <mtime> <path>", then "F <file>" and
+    // "S <subdir>" lines
+    std::string serialize_listings(const std::vector<scan::Directory>& dirs) {
+        std::string out;
+        for (const auto& dir : dirs) {
+            out += "D " + std::to_string(dir.mtime) + " " + dir.path + "\n";
+            for (const auto& file : dir.files) {
+                if (is_header(file)) out += "F " + file + "\n";
+            }
+            for (const auto& sub : dir.subdirs) out += "S " + sub + "\n";
+        }
+        return out;
+    }
+
+    std::map<std::string, scan::Directory> parse_listings(std::string_view data) {
+        std::map<std::string, scan::Directory> dirs;
+        scan::Directory* current = nullptr;
+        while (!data.empty()) {
+            size_t newline = data.find('\n');
+            std::string_view line = data.substr(0, newline);
+            data.remove_prefix(newline == std::string_view::npos ? data.size() : newline + 1);
+            if (line.size() < 3) continue;
+
+            if (line[0] == 'D') {
+                size_t space = line.find(' ', 2);
+                if (space == std::string_view::npos) continue;
+                std::string path(line.substr(space + 1));
+                current = &dirs[path];
+                current->path = path;
+                current->mtime = std::strtoll(std::string(line.substr(2, space - 2)).c_str(), nullptr, 10);
+            } else if (current && line[0] == 'F') {
+                current->files.emplace_back(line.substr(2));
+            } else if (current && line[0] == 'S') {
+                current->subdirs.emplace_back(line.substr(2));
+            }
+        }
+        return dirs;
+    }
+
+    const cache::HashMapView& system_index() {
+        static std::unique_ptr<cache::IndexReader> reader;
+        static cache::HashMapView view;
+        if (reader) return view;
+
+        std::string path = cache::path_for("headers.idx");
+        reader = std::make_unique<cache::IndexReader>(path);
+        auto previous = parse_listings(reader->section(LISTINGS));
+
+        // Every directory is stat'ed, only changed ones are read again. The
+        // callback runs on the walker's threads, so it only reads previous;
+        // what changed is worked out from the result.
+        auto dirs = scan::walk(system_roots(), scan::Options{}, [&](const std::string& dir, int64_t mtime, scan::Directory& out) {
+            auto it = previous.find(dir);
+            if (it == previous.end() || it->second.mtime != mtime) return false;
+            out.files = it->second.files;
+            out.subdirs = it->second.subdirs;
+            return true;
+        });
+        bool changed = !reader->valid() || dirs.size() != previous.size() ||
+                       std::any_of(dirs.begin(), dirs.end(), [&](const scan::Directory& dir) {
+                           auto it = previous.find(dir.path);
+                           return it == previous.end() || it->second.mtime != dir.mtime;
+                       });
+
+        if (changed) {
+            cache::HashMapBuilder index;
+            add_listings(index, dirs);
+            cache::IndexWriter writer;
+            writer.add_section(HEADERS, index.serialize());
+            writer.add_section(LISTINGS, serialize_listings(dirs));
+            writer.publish(path, cache::combined_stamp(system_roots()));
+            reader = std::make_unique<cache::IndexReader>(path);
+        }
+        view = cache::HashMapView(reader->section(HEADERS));
+        return view;
+    }
+
+    // Headers in the project around the working directory; cheap enough to
+    // walk on demand and too volatile to be worth persisting
+    const cache::HashMapView& project_index() {
+        static std::string blob;
+        static cache::HashMapView view;
+        static bool loaded = false;
+        if (!loaded) {
+            loaded = true;
+            scan::Options options;
+            options.max_depth = 4;
+            options.max_dirs = 5000;
+            options.skip = {".git", ".hg", ".svn", "node_modules", "target", ".cache"};
+
+            cache::HashMapBuilder index;
+            add_listings(index, scan::walk({utils::current_dir()}, options));
+            blob = index.serialize();
+            view = cache::HashMapView(blob);
+        }
+        return view;
+    }
+
+    // Directories containing a header named file, project ones first
+    std::vector<std::string> directories_with(std::string_view file) {
+        std::vector<std::string> dirs;
+        for (const auto* view : {&project_index(), &system_index()}) {
+            if (auto found = view->find(file)) {
+                for (const auto& dir : utils::split(std::string(*found), '\n')) dirs.push_back(dir);
+            }
+        }
+        return dirs;
+    }
+
+    struct MissingInclude {
+        std::string source;
+        std::string line;
+        std::string header;
+    };
+
+    // gcc: "x.c:3:10: fatal error: foo/bar.h: No such file or directory"
+    // clang: "x.c:3:10: fatal error: 'foo/bar.h' file not found"
+    std::optional<MissingInclude> parse_error(std::string_view output) {
+        for (const auto& text : utils::split(std::string(output), '\n')) {
+            size_t pos = text.find(": fatal error: ");
+            if (pos == std::string::npos) continue;
+
+            MissingInclude missing;
+            std::string rest = text.substr(pos + 15);
+            if (utils::ends_with(rest, ": No such file or directory")) {
+                missing.header = rest.substr(0, rest.size() - 27);
+            } else if (utils::ends_with(rest, "' file not found") && rest[0] == '\'') {
+                missing.header = rest.substr(1, rest.size() - 17);
+            } else {
+                continue;
+            }
+
+            auto location = utils::split(text.substr(0, pos), ':');
+            if (location.size() >= 2) {
+                missing.source = location[0];
+                missing.line = location[1];
+            }
+            return missing;
+        }
+        return std::nullopt;
+    }
+
+    std::string relative_to_cwd(const std::string& dir) {
+        std::string cwd = utils::current_dir();
+        if (dir == cwd) return ".";
+        if (utils::starts_with(dir, cwd + "/")) return dir.substr(cwd.size() + 1);
+        return dir;
+    }
+}
+
+RULE_CLASS(MissingHeaderRule);
+bool MissingHeaderRule::match(const Command& cmd) const {
+    return libraries::is_link_command(cmd) &&
+           utils::contains(cmd.output, "fatal error: ") &&
+           headers::parse_error(cmd.output).has_value() &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> MissingHeaderRule::get_new_command(const Command& cmd) const {
+    auto missing = headers::parse_error(cmd.output);
+    if (!missing) return {};
+
+    std::string header = missing->header;
+    size_t slash = header.rfind('/');
+    std::string file = header.substr(slash == std::string::npos ? 0 : slash + 1);
+    std::string prefix = slash == std::string::npos ? "" : "/" + header.substr(0, slash);
+
+    std::vector<std::string> suggestions;
+    auto add_include_dir = [&](const std::string& root, std::string fixed) {
+        if (!headers::is_default_dir(root)) {
+            std::string flag = "-I" + headers::relative_to_cwd(root);
+            if (std::find(cmd.script_parts.begin(), cmd.script_parts.end(), flag) == cmd.script_parts.end()) {
+                fixed += " " + flag;
+            } else if (fixed == cmd.script) {
+                return;
+            }
+        }
+        if (std::find(suggestions.begin(), suggestions.end(), fixed) == suggestions.end()) suggestions.push_back(fixed);
+    };
+
+    // The header exists under the spelled path, only the -I is missing
+    for (const auto& dir : headers::directories_with(file)) {
+        if (utils::ends_with(dir, prefix) && !headers::is_default_dir(dir.substr(0, dir.size() - prefix.size()))) {
+            add_include_dir(dir.substr(0, dir.size() - prefix.size()), cmd.script);
+        }
+    }
+    if (!suggestions.empty()) return suggestions;
+
+    // Otherwise look for a near spelling of the include path: try every
+    // header whose name is close, comparing path suffixes of equal depth
+    if (missing->source.empty() || missing->line.empty()) return {};
+    size_t depth = std::count(header.begin(), header.end(), '/');
+    std::set<std::string_view> names = {file};
+    for (const auto* view : {&headers::project_index(), &headers::system_index()}) {
+        for (uint32_t i = 0; i < view->size(); i++) names.insert(view->key(i));
+    }
+
+    std::vector<std::pair<int, std::pair<std::string, std::string>>> spellings; // (distance, (root, spelling))
+    for (const auto& name : names) {
+        if (fuzzy::osa_distance(file, name, fuzzy::max_distance_for(file)) > fuzzy::max_distance_for(file)) continue;
+        for (const auto& dir : headers::directories_with(name)) {
+            // Take the last `depth` components of dir as the include prefix
+            std::string root = dir;
+            std::string spelled(name);
+            bool ok = true;
+            for (size_t i = 0; i < depth; i++) {
+                size_t cut = root.rfind('/');
+                if (cut == std::string::npos || cut == 0) { ok = false; break; }
+                spelled = root.substr(cut + 1) + "/" + spelled;
+                root = root.substr(0, cut);
+            }
+            if (!ok || spelled == header) continue;
+            int dist = fuzzy::osa_distance(header, spelled, fuzzy::max_distance_for(header));
+            if (dist <= fuzzy::max_distance_for(header)) spellings.push_back({dist, {root, spelled}});
+        }
+    }
+    std::stable_sort(spellings.begin(), spellings.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // Paths go into a basic regex and its replacement: escape what sed
+    // would read as syntax there, including the | delimiter
+    auto sed_escape = [](const std::string& text, const char* special) {
+        std::string escaped;
+        for (char c : text) {
+            if (std::strchr(special, c)) escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    };
+    for (const auto& [dist, fix] : spellings) {
+        std::string script = missing->line + "s|" + sed_escape(header, "\\|.[]*^$") + "|" +
+                             sed_escape(fix.second, "\\|&") + "|";
+        std::string sed = "sed -i " + utils::shell_quote(script) + " " + utils::shell_quote(missing->source);
+        add_include_dir(fix.first, sed + " && " + cmd.script);
+        if (suggestions.size() >= 3) break;
+    }
+    return suggestions;
+}
+
+// The dynamic loader's cache, parsed directly instead of via `ldconfig -p`
+namespace ldcache {
+    // Old format: "ld.so-1.7.0", u32 count, {i32 flags, u32 key, u32 value}[]
+    // with string offsets relative to the table end. glibc >= 2.32 writes
+    // only the new format, older releases append it after the old table.
+    constexpr char OLD_MAGIC[] = "ld.so-1.7.0";
+    constexpr char NEW_MAGIC[] = "glibc-ld.so.cache1.1";
+
+    struct OldEntry {
+        int32_t flags;
+        uint32_t key;
+        uint32_t value;
+    };
+
+    struct NewHeader {
+        char magic[20];
+        uint32_t count;
+        uint32_t string_length;
+        uint8_t flags;
+        uint8_t padding[3];
+        uint32_t extension_offset;
+        uint32_t unused[3];
+    };
+
+    struct NewEntry {
+        int32_t flags;
+        uint32_t key;
+        uint32_t value;
+        uint32_t os_version;
+        uint64_t hwcap;
+    };
+
+    std::string_view string_at(std::string_view data, size_t offset) {
+        if (offset >= data.size()) return {};
+        std::string_view s = data.substr(offset);
+        return s.substr(0, s.find('\0'));
+    }
+
+    // (soname, path) pairs of every library in the cache
+    std::vector<std::pair<std::string, std::string>> parse(std::string_view data) {
+        std::vector<std::pair<std::string, std::string>> entries;
+        size_t new_start = 0;
+
+        if (data.size() >= 16 && data.substr(0, sizeof(OLD_MAGIC) - 1) == OLD_MAGIC) {
+            uint32_t count = cache::load<uint32_t>(data.data() + 12);
+            size_t table_end = 16 + static_cast<size_t>(count) * sizeof(OldEntry);
+            if (table_end > data.size()) return entries;
+
+            new_start = (table_end + 7) & ~size_t(7);
+            bool has_new = new_start + sizeof(NewHeader) <= data.size() &&
+                           data.substr(new_start, sizeof(NEW_MAGIC) - 1) == NEW_MAGIC;
+            if (!has_new) {
+                std::string_view strings = data.substr(table_end);
+                for (uint32_t i = 0; i < count; i++) {
+                    auto entry = cache::load<OldEntry>(data.data() + 16 + i * sizeof(OldEntry));
+                    entries.emplace_back(string_at(strings, entry.key), string_at(strings, entry.value));
+                }
+                return entries;
+            }
+        }
+
+        if (new_start + sizeof(NewHeader) > data.size() ||
+            data.substr(new_start, sizeof(NEW_MAGIC) - 1) != NEW_MAGIC) {
+            return entries;
+        }
+
+        // New format offsets are relative to the start of its header
+        std::string_view base = data.substr(new_start);
+        auto header = cache::load<NewHeader>(base.data());
+        if (sizeof(NewHeader) + static_cast<size_t>(header.count) * sizeof(NewEntry) > base.size()) return entries;
+        for (uint32_t i = 0; i < header.count; i++) {
+            auto entry = cache::load<NewEntry>(base.data() + sizeof(NewHeader) + i * sizeof(NewEntry));
+            entries.emplace_back(string_at(base, entry.key), string_at(base, entry.value));
+        }
+        return entries;
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& entries() {
+        static std::vector<std::pair<std::string, std::string>> cached;
+        static bool loaded = false;
+        if (!loaded) {
+            loaded = true;
+            cache::MappedFile file("/etc/ld.so.cache");
+            cached = parse(file.data());
+        }
+        return cached;
+    }
+
+    bool contains(const std::string& soname) {
+        for (const auto& entry : entries()) {
+            if (entry.first == soname) return true;
+        }
+        return false;
+    }
+
+    // Library directories the loader does not know about: anything from the
+    // usual candidates that no cache entry points into
+    std::vector<std::string> uncached_dirs() {
+        // Compare resolved paths: the cache may say /lib where the
+        // candidates say /usr/lib
+        std::set<std::string> cached;
+        for (const auto& entry : entries()) cached.insert(utils::dirname(entry.second));
+        for (const auto& dir : std::set<std::string>(cached)) {
+            char resolved[PATH_MAX];
+            if (realpath(dir.c_str(), resolved)) cached.insert(resolved);
+        }
+
+        std::vector<std::string> candidates = {"/usr/local/lib", "/usr/local/lib64"};
+        if (const char* home = std::getenv("HOME")) {
+            candidates.push_back(std::string(home) + "/.local/lib");
+        }
+        for (const auto& name : stream::list_dir("/opt")) {
+            candidates.push_back("/opt/" + name + "/lib");
+            candidates.push_back("/opt/" + name + "/lib64");
+        }
+        for (const auto& dir : libraries::search_dirs()) candidates.push_back(dir);
+
+        std::vector<std::string> dirs;
+        for (const auto& dir : candidates) {
+            if (!cached.count(dir) && utils::is_directory(dir) &&
+                std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+                dirs.push_back(dir);
+            }
+        }
+        return dirs;
+    }
+
+    // soname -> directories, for shared libraries outside the cache
+    const cache::HashMapView& uncached_index() {
+        static std::unique_ptr<cache::IndexReader> reader;
+        static cache::HashMapView view;
+        if (!reader) {
+            auto dirs = uncached_dirs();
+            auto stamped = dirs;
+            stamped.push_back("/etc/ld.so.cache");
+            reader = cache::open_index("uncached-libs.idx", cache::combined_stamp(stamped), [&](cache::IndexWriter& writer) {
+                cache::HashMapBuilder index;
+                scan::Options options;
+                options.max_depth = 0;
+                for (const auto& dir : scan::walk(dirs, options)) {
+                    for (const auto& file : dir.files) {
+                        if (utils::starts_with(file, "lib") && utils::contains(file, ".so")) index.add(file, dir.path);
+                    }
+                }
+                writer.add_section(cache::section_id("LIBS"), index.serialize());
+            });
+            view = cache::HashMapView(reader->section(cache::section_id("LIBS")));
+        }
+        return view;
+    }
+
+    // "libfoo.so.3" -> "libfoo.so."
+    std::string version_stem(const std::string& soname) {
+        size_t so = soname.find(".so");
+        if (so == std::string::npos) return soname;
+        return soname.substr(0, so + 3) + ".";
+    }
+
+    // The soname from "error while loading shared libraries: libfoo.so.3: cannot open ..."
+    std::string missing_library(std::string_view output) {
+        const std::string_view marker = "error while loading shared libraries: ";
+        size_t pos = output.find(marker);
+        if (pos == std::string_view::npos) return "";
+        pos += marker.size();
+        size_t end = output.find(':', pos);
+        if (end == std::string_view::npos) return "";
+        return std::string(output.substr(pos, end - pos));
+    }
+}
+
+RULE_CLASS(SharedLibraryNotFoundRule);
+bool SharedLibraryNotFoundRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "error while loading shared libraries") &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> SharedLibraryNotFoundRule::get_new_command(const Command& cmd) const {
+    std::string soname = ldcache::missing_library(cmd.output);
+    if (soname.empty()) return {};
+
+    std::vector<std::string> suggestions;
+    auto add = [&](const std::string& fixed) {
+        if (std::find(suggestions.begin(), suggestions.end(), fixed) == suggestions.end()) suggestions.push_back(fixed);
+    };
+    auto library_path = [&](const std::string& dir) {
+        const char* current = std::getenv("LD_LIBRARY_PATH");
+        std::string value = utils::shell_quote(dir);
+        if (current && *current) value += ":$LD_LIBRARY_PATH";
+        return "LD_LIBRARY_PATH=" + value + " " + cmd.script;
+    };
+    auto with_library_path = [&](const std::string& dir) { add(library_path(dir)); };
+
+    // Present on disk, just not where the loader looks
+    if (auto dirs = ldcache::uncached_index().find(soname)) {
+        for (const auto& dir : utils::split(std::string(*dirs), '\n')) with_library_path(dir);
+    }
+
+    auto from_packages = [&](const std::string& name) {
+        for (const auto& provider : packages::providers(name)) {
+            if (provider.installed) {
+                if (!ldcache::contains(name) && utils::file_exists(provider.path)) {
+                    with_library_path(utils::dirname(provider.path));
+                }
+            } else {
+                add("sudo apt install " + provider.package + " && " + cmd.script);
+            }
+        }
+    };
+    from_packages(soname);
+
+    // Version match: libfoo.so.3 missing, libfoo.so.3.1 on disk or in a
+    // package. Only versions that extend the requested one are ABI
+    // compatible (libfoo.so.3.1, not libfoo.so.30), and those are a prefix
+    // range of the sorted indices.
+    if (suggestions.empty()) {
+        const auto& on_disk = ldcache::uncached_index();
+        const auto& in_packages = packages::file_index();
+        auto with_prefix = [&](const std::string& prefix) {
+            std::vector<std::string> names;
+            for (const auto* index : {&on_disk, &in_packages}) {
+                for (uint32_t i = index->lower_bound(prefix); i < index->size(); i++) {
+                    std::string_view key = index->key(i);
+                    if (!utils::starts_with(key, prefix)) break;
+                    if (std::find(names.begin(), names.end(), key) == names.end()) names.emplace_back(key);
+                }
+            }
+            return names;
+        };
+
+        // Closest version first: libfoo.so.3.1 before libfoo.so.3.1.2
+        std::vector<std::string> versions = with_prefix(soname + ".");
+        std::stable_sort(versions.begin(), versions.end(),
+                         [](const std::string& a, const std::string& b) { return a.size() < b.size(); });
+        if (versions.empty()) {
+            // libfoo.so.3.1 missing: any libfoo.so.3.x shares the major
+            // version, the nearest one is the best guess
+            std::string stem = ldcache::version_stem(soname);
+            std::string major = soname.substr(0, soname.find('.', stem.size()));
+            if (major.size() > stem.size() && major != soname) {
+                auto candidates = with_prefix(major);
+                candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](const std::string& name) {
+                    return name != major && !utils::starts_with(name, major + ".");
+                }), candidates.end());
+                for (const auto& match : fuzzy::closest_matches(soname, candidates, static_cast<int>(soname.size()))) {
+                    versions.push_back(match.command);
+                }
+            }
+        }
+
+        // The loader asks for the soname itself, so a library path alone
+        // won't find libfoo.so.3.1; link it under that name
+        auto link_as_soname = [&](const std::string& path) {
+            std::string dir = utils::dirname(path);
+            return (access(dir.c_str(), W_OK) == 0 ? "ln -s " : "sudo ln -s ") + utils::shell_quote(path) + " " +
+                   utils::shell_quote(dir + "/" + soname) + " && ";
+        };
+        for (const auto& version : versions) {
+            if (suggestions.size() >= 3) break;
+            if (auto dirs = on_disk.find(version)) {
+                for (const auto& dir : utils::split(std::string(*dirs), '\n')) {
+                    add(link_as_soname(dir + "/" + version) + library_path(dir));
+                }
+            }
+            for (const auto& provider : packages::providers(version)) {
+                if (provider.installed && utils::file_exists(provider.path)) {
+                    if (ldcache::contains(version)) {
+                        add(link_as_soname(provider.path) + "sudo ldconfig && " + cmd.script);
+                    } else {
+                        add(link_as_soname(provider.path) + library_path(utils::dirname(provider.path)));
+                    }
+                } else if (!provider.installed) {
+                    add("sudo apt install " + provider.package + " && " + cmd.script);
+                }
+            }
+        }
+    }
+
+    if (suggestions.size() > 3) suggestions.resize(3);
+    return suggestions;
+}
+
+// Importable Python modules of the interpreter on PATH, read from its
+// site-packages without running Python
+namespace python {
+    // Find an executable the way the shell would
+    std::string which(const std::string& name) {
+        if (name.find('/') != std::string::npos) return access(name.c_str(), X_OK) == 0 ? name : "";
+        const char* path_env = std::getenv("PATH");
+        if (!path_env) return "";
+        for (const auto& dir : utils::split(path_env, ':')) {
+            std::string candidate = dir + "/" + name;
+            if (access(candidate.c_str(), X_OK) == 0 && !utils::is_directory(candidate)) return candidate;
+        }
+        return "";
+    }
+
+    std::string resolve(const std::string& path) {
+        char resolved[PATH_MAX];
+        return realpath(path.c_str(), resolved) ? resolved : path;
+    }
+
+    // pyenv shims are shell scripts; follow them to the selected version
+    std::string unshim(const std::string& interpreter) {
+        size_t shims = interpreter.find("/.pyenv/shims/");
+        if (shims == std::string::npos) return interpreter;
+        std::string root = interpreter.substr(0, shims) + "/.pyenv";
+        std::string name = interpreter.substr(shims + 14);
+
+        std::string version;
+        if (const char* env = std::getenv("PYENV_VERSION")) version = env;
+        if (version.empty()) {
+            std::string file = project::find_upwards(".python-version");
+            if (file.empty()) file = root + "/version";
+            std::istringstream iss(utils::read_file(file));
+            iss >> version;
+        }
+        std::string candidate = root + "/versions/" + version + "/bin/" + name;
+        return version.empty() || version == "system" || !utils::file_exists(candidate) ? interpreter : candidate;
+    }
+
+    // Directories whose contents are importable by interpreter: the
+    // stdlib, lib-dynload, site/dist-packages, user site and venv packages
+    std::vector<std::string> search_dirs(const std::string& interpreter) {
+        std::string bin_dir = utils::dirname(unshim(interpreter));
+        std::string real = resolve(unshim(interpreter));
+        std::string prefix = utils::dirname(utils::dirname(real));
+
+        // A venv has pyvenv.cfg next to its bin directory
+        std::string venv = utils::dirname(bin_dir);
+        bool system_site = true;
+        if (utils::file_exists(venv + "/pyvenv.cfg")) {
+            system_site = utils::contains(utils::read_file(venv + "/pyvenv.cfg"), "include-system-site-packages = true");
+        } else {
+            venv.clear();
+        }
+
+        // python3.11 -> 3.11; otherwise take whatever lib/python3.* exists
+        std::string base = real.substr(real.rfind('/') + 1);
+        std::vector<std::string> versions;
+        if (utils::starts_with(base, "python") && base.find('.') != std::string::npos) {
+            versions.push_back(base.substr(6));
+        } else {
+            for (const auto& name : stream::list_dir(prefix + "/lib")) {
+                if (utils::starts_with(name, "python3.")) versions.push_back(name.substr(6));
+            }
+        }
+
+        std::vector<std::string> dirs;
+        auto add = [&](const std::string& dir) {
+            if (utils::is_directory(dir) && std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) dirs.push_back(dir);
+        };
+        for (const auto& version : versions) {
+            std::string lib = "/lib/python" + version;
+            add(prefix + lib);
+            add(prefix + lib + "/lib-dynload");
+            if (!venv.empty()) add(venv + lib + "/site-packages");
+            if (!system_site) continue;
+
+            add(prefix + lib + "/site-packages");
+            // Debian keeps distro and pip packages apart
+            add(prefix + lib + "/dist-packages");
+            add("/usr/lib/python3/dist-packages");
+            add("/usr/local" + lib + "/dist-packages");
+            if (const char* home = std::getenv("HOME")) add(std::string(home) + "/.local" + lib + "/site-packages");
+        }
+        return dirs;
+    }
+
+    bool is_identifier(const std::string& name) {
+        if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) return false;
+        return std::all_of(name.begin(), name.end(), [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        });
+    }
+
+    // Entries are module names, or "dist=module" for distributions whose
+    // name differs from the module they install (PyYAML=yaml)
+    cache::NameList scan(const std::vector<std::string>& dirs) {
+        cache::NameList list;
+        std::set<std::string> names;
+
+        for (const auto& dir : dirs) {
+            list.sources.push_back(cache::stamp_of(dir));
+            for (const auto& entry : stream::list_dir(dir)) {
+                std::string path = dir + "/" + entry;
+
+                if (utils::ends_with(entry, ".dist-info") || utils::ends_with(entry, ".egg-info")) {
+                    // "PyYAML-6.0.dist-info", "ruamel.yaml-0.17.dist-info",
+                    // "foo-1.0-py3.8.egg-info" or a versionless "foo.egg-info"
+                    std::string dist = entry.substr(0, entry.find('-'));
+                    if (utils::ends_with(entry, ".egg-info") && utils::ends_with(dist, ".egg")) {
+                        dist = dist.substr(0, dist.size() - 4);
+                    }
+                    std::vector<std::string> tops = utils::split(utils::read_file(path + "/top_level.txt"), '\n');
+                    if (tops.empty()) {
+                        // No top_level.txt: the first path component of each RECORD row
+                        stream::for_each_line(path + "/RECORD", [&](std::string_view row) {
+                            std::string top(row.substr(0, row.find_first_of("/,")));
+                            if (utils::ends_with(top, ".py")) top = top.substr(0, top.size() - 3);
+                            if (is_identifier(top) && std::find(tops.begin(), tops.end(), top) == tops.end()) {
+                                tops.push_back(top);
+                            }
+                        });
+                    }
+                    for (auto& top : tops) {
+                        top.erase(std::remove(top.begin(), top.end(), '\r'), top.end());
+                        if (!is_identifier(top)) continue;
+                        names.insert(top);
+                        if (utils::to_lower(dist) != utils::to_lower(top)) names.insert(dist + "=" + top);
+                    }
+                    continue;
+                }
+
+                std::string module = entry;
+                if (utils::ends_with(entry, ".py")) {
+                    module = entry.substr(0, entry.size() - 3);
+                } else if (utils::contains(entry, ".so") || utils::ends_with(entry, ".pyd")) {
+                    module = entry.substr(0, entry.find('.'));
+                } else if (!utils::is_directory(path)) {
+                    continue;
+                }
+                if (is_identifier(module) && module != "__pycache__" && module != "__init__") names.insert(module);
+            }
+        }
+
+        list.names.assign(names.begin(), names.end());
+        return list;
+    }
+
+    std::vector<std::string> modules(const std::string& interpreter) {
+        auto dirs = search_dirs(interpreter);
+        if (dirs.empty()) return {};
+        return cache::cached_names("python", utils::join(dirs, ":"), [&]() { return scan(dirs); });
+    }
+
+    // "No module named 'nmupy'" (import) or "No module named nmupy" (-m)
+    std::string missing_module(std::string_view output) {
+        const std::string_view marker = "No module named ";
+        size_t pos = output.rfind(marker);
+        if (pos == std::string_view::npos) return "";
+        pos += marker.size();
+        if (pos < output.size() && output[pos] == '\'') pos++;
+        size_t end = output.find_first_of("'\r\n", pos);
+        std::string name(output.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+        // Only the top-level package is indexed
+        return name.substr(0, name.find('.'));
+    }
+
+    // Replace whole-identifier occurrences of from in text
+    std::string replace_identifier(const std::string& text, const std::string& from, const std::string& to) {
+        std::string result;
+        size_t pos = 0;
+        while (true) {
+            size_t found = text.find(from, pos);
+            if (found == std::string::npos) break;
+            auto is_ident = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+            bool boundary = (found == 0 || !is_ident(text[found - 1])) &&
+                            (found + from.size() == text.size() || !is_ident(text[found + from.size()]));
+            result += text.substr(pos, found - pos) + (boundary ? to : from);
+            pos = found + from.size();
+        }
+        return result + text.substr(pos);
+    }
+}
+
+RULE_CLASS(PythonModuleNotFoundRule);
+bool PythonModuleNotFoundRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "No module named ") &&
+           !cmd.script_parts.empty() &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> PythonModuleNotFoundRule::get_new_command(const Command& cmd) const {
+    std::string module = python::missing_module(cmd.output);
+    if (module.empty()) return {};
+
+    std::string tool = cmd.script_parts[0].substr(cmd.script_parts[0].rfind('/') + 1);
+    std::string interpreter = python::which(utils::starts_with(tool, "python") ? cmd.script_parts[0] : "python3");
+    if (interpreter.empty()) return {};
+
+    std::vector<std::string> modules;
+    std::map<std::string, std::string> by_distribution;
+    for (const auto& name : python::modules(interpreter)) {
+        size_t eq = name.find('=');
+        if (eq == std::string::npos) {
+            // Private modules are only suggested for private-looking typos
+            if (name[0] != '_' || module[0] == '_') modules.push_back(name);
+        } else {
+            by_distribution[name.substr(0, eq)] = name.substr(eq + 1);
+        }
+    }
+    if (std::find(modules.begin(), modules.end(), module) != modules.end()) return {};
+
+    // Distribution names count as spellings of the module they install
+    std::vector<std::string> candidates = modules;
+    for (const auto& entry : by_distribution) candidates.push_back(entry.first);
+
+    std::vector<std::string> fixes;
+    for (const auto& match : fuzzy::closest_matches(module, candidates, fuzzy::max_distance_for(module), 8)) {
+        std::string fixed = by_distribution.count(match.command) ? by_distribution[match.command] : match.command;
+        if (std::find(fixes.begin(), fixes.end(), fixed) == fixes.end()) fixes.push_back(fixed);
+    }
+    // Case-only differences are beyond the edit budget of short names
+    for (const auto& entry : by_distribution) {
+        if (utils::to_lower(entry.first) == utils::to_lower(module) &&
+            std::find(fixes.begin(), fixes.end(), entry.second) == fixes.end()) {
+            fixes.insert(fixes.begin(), entry.second);
+        }
+    }
+
+    // Only the command line is corrected (python -m nmupy, python -c
+    // 'import nmupy'); an import inside a source file is left to the user
+    std::vector<std::string> suggestions;
+    for (const auto& fixed : fixes) {
+        std::string corrected = python::replace_identifier(cmd.script, module, fixed);
+        if (corrected != cmd.script) suggestions.push_back(corrected);
+        if (suggestions.size() >= 3) break;
+    }
+    return suggestions;
+}
+
+// systemd unit names from the unit search paths, so corrections never need
+// `systemctl list-unit-files`
+namespace systemd {
+    std::vector<std::string> unit_dirs(bool user) {
+        if (user) {
+            std::vector<std::string> dirs;
+            const char* config = std::getenv("XDG_CONFIG_HOME");
+            const char* home = std::getenv("HOME");
+            if (config && *config) {
+                dirs.push_back(std::string(config) + "/systemd/user");
+            } else if (home) {
+                dirs.push_back(std::string(home) + "/.config/systemd/user");
+            }
+            for (const char* dir : {"/etc/systemd/user", "/run/systemd/user", "/usr/local/lib/systemd/user",
+                                    "/usr/lib/systemd/user", "/lib/systemd/user"}) {
+                dirs.emplace_back(dir);
+            }
+            return dirs;
+        }
+        return {"/etc/systemd/system", "/run/systemd/system", "/usr/local/lib/systemd/system",
+                "/usr/lib/systemd/system", "/lib/systemd/system"};
+    }
+
+    bool is_unit_file(const std::string& name) {
+        for (const char* suffix : {".service", ".socket", ".target", ".timer", ".mount", ".automount",
+                                   ".path", ".slice", ".scope", ".swap", ".device"}) {
+            if (utils::ends_with(name, suffix)) return true;
+        }
+        return false;
+    }
+
+    // Unit files, alias symlinks and templates (foo@.service)
+    std::vector<std::string> units(bool user) {
+        auto dirs = unit_dirs(user);
+        return cache::cached_names("systemd", utils::join(dirs, ":"), [&]() {
+            cache::NameList list;
+            std::set<std::string> names;
+            scan::Options options;
+            options.max_depth = 0;
+            for (const auto& dir : dirs) list.sources.push_back(cache::stamp_of(dir));
+            for (const auto& dir : scan::walk(dirs, options)) {
+                for (const auto& file : dir.files) {
+                    if (is_unit_file(file)) names.insert(file);
+                }
+            }
+            list.names.assign(names.begin(), names.end());
+            return list;
+        });
+    }
+
+    // Closest units to what was typed, spelled the way it was typed:
+    // "ngnix" -> "nginx", "ngnix.service" -> "nginx.service",
+    // "gety@tty1" -> "getty@tty1"
+    std::vector<std::string> correct(const std::string& typed, const std::vector<std::string>& names) {
+        std::string name = typed;
+        std::string instance;
+        size_t at = name.find('@');
+        std::string suffix = ".service";
+        size_t dot = name.rfind('.');
+        if (dot != std::string::npos && dot > (at == std::string::npos ? 0 : at) && is_unit_file(name)) {
+            suffix = name.substr(dot);
+            name = name.substr(0, dot);
+        }
+        bool typed_suffix = name.size() != typed.size();
+        if (at != std::string::npos) {
+            instance = name.substr(at + 1);
+            name = name.substr(0, at + 1);
+        }
+
+        // Compare stems of units with the same suffix
+        std::vector<std::string> stems;
+        for (const auto& unit : names) {
+            if (!utils::ends_with(unit, suffix)) continue;
+            std::string stem = unit.substr(0, unit.size() - suffix.size());
+            // Templates only match instantiated names and vice versa
+            if (instance.empty() == utils::ends_with(stem, "@")) continue;
+            stems.push_back(stem);
+        }
+        if (std::find(stems.begin(), stems.end(), name) != stems.end()) return {};
+
+        std::vector<std::string> fixes;
+        for (const auto& match : fuzzy::closest_matches(name, stems)) {
+            fixes.push_back(match.command + instance + (typed_suffix ? suffix : ""));
+        }
+        return fixes;
+    }
+
+    bool is_unit_command(const Command& cmd) {
+        for (const auto& part : cmd.script_parts) {
+            if (part == "systemctl" || part == "journalctl" ||
+                utils::ends_with(part, "/systemctl") || utils::ends_with(part, "/journalctl")) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+RULE_CLASS(SystemdUnitNotFoundRule);
+bool SystemdUnitNotFoundRule::match(const Command& cmd) const {
+    return systemd::is_unit_command(cmd) &&
+           (utils::contains(cmd.output, " not found") ||
+            utils::contains(cmd.output, "could not be found") ||
+            utils::contains(cmd.output, "-- No entries --")) &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> SystemdUnitNotFoundRule::get_new_command(const Command& cmd) const {
+    bool user = std::find(cmd.script_parts.begin(), cmd.script_parts.end(), "--user") != cmd.script_parts.end();
+    auto names = systemd::units(user);
+    if (names.empty()) return {};
+
+    // Unit arguments: everything after the tool that is not an option or
+    // the systemctl verb; journalctl only takes units via -u/--unit
+    bool journal = false, after_tool = false, verb_seen = false;
+    for (size_t i = 0; i < cmd.script_parts.size(); i++) {
+        const std::string& part = cmd.script_parts[i];
+        if (!after_tool) {
+            after_tool = utils::ends_with(part, "systemctl") || utils::ends_with(part, "journalctl");
+            journal = utils::ends_with(part, "journalctl");
+            continue;
+        }
+
+        size_t index = i;
+        std::string unit;
+        if (journal) {
+            if ((part == "-u" || part == "--unit") && i + 1 < cmd.script_parts.size()) {
+                index = ++i;
+                unit = cmd.script_parts[index];
+            } else if (utils::starts_with(part, "--unit=")) {
+                unit = part.substr(7);
+            }
+        } else if (part[0] != '-') {
+            if (!verb_seen) {
+                verb_seen = true;
+                continue;
+            }
+            unit = part;
+        }
+        if (unit.empty()) continue;
+
+        auto fixes = systemd::correct(unit, names);
+        if (fixes.empty()) continue;
+
+        std::vector<std::string> suggestions;
+        for (const auto& fix : fixes) {
+            auto parts = cmd.script_parts;
+            parts[index] = utils::starts_with(part, "--unit=") ? "--unit=" + fix : fix;
+            suggestions.push_back(utils::join(parts));
+        }
+        return suggestions;
+    }
+    return {};
+}
+
+// Man page names across the man path, indexed with the same walker and
+// cache format as the PATH index
+namespace man {
+    // The man-db configuration, the man directories next to each of dirs
+    // and the usual defaults
+    std::vector<std::string> configured(const std::vector<std::string>& bin_dirs) {
+        std::vector<std::string> dirs;
+        std::map<std::string, std::string> bin_to_man;
+        for (const char* config : {"/etc/manpath.config", "/etc/man_db.conf"}) {
+            stream::for_each_line(config, [&](std::string_view line) {
+                std::istringstream iss{std::string(line)};
+                std::string key, first, second;
+                iss >> key >> first >> second;
+                if (key == "MANDATORY_MANPATH" && !first.empty()) dirs.push_back(first);
+                if (key == "MANPATH_MAP" && !second.empty()) bin_to_man.emplace(first, second);
+            });
+        }
+        for (const auto& dir : bin_dirs) {
+            auto mapped = bin_to_man.find(dir);
+            if (mapped != bin_to_man.end()) dirs.push_back(mapped->second);
+            dirs.push_back(utils::dirname(dir) + "/share/man");
+            dirs.push_back(utils::dirname(dir) + "/man");
+        }
+        for (const char* dir : {"/usr/share/man", "/usr/local/share/man", "/usr/local/man"}) dirs.emplace_back(dir);
+        return dirs;
+    }
+
+    std::vector<std::string> existing(const std::vector<std::string>& candidates) {
+        std::vector<std::string> dirs;
+        for (const auto& dir : candidates) {
+            if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end() && utils::is_directory(dir)) dirs.push_back(dir);
+        }
+        return dirs;
+    }
+
+    // What the shared index covers: the configured roots for the system
+    // PATH directories, the same for every user
+    std::vector<std::string> system_roots() {
+        return existing(configured(fuzzy::system_path_dirs()));
+    }
+
+    // $MANPATH, or the configured roots for the caller's PATH
+    std::vector<std::string> manpath() {
+        auto defaults = configured(fuzzy::path_dirs());
+        std::vector<std::string> candidates;
+        const char* env = std::getenv("MANPATH");
+        if (env && *env) {
+            // An empty component stands for the configured path
+            std::string value = std::string(":") + env + ":";
+            for (size_t start = 0, end; (end = value.find(':', start + 1)) != std::string::npos; start = end) {
+                std::string dir = value.substr(start + 1, end - start - 1);
+                if (dir.empty() && start > 0) {
+                    candidates.insert(candidates.end(), defaults.begin(), defaults.end());
+                } else if (!dir.empty()) {
+                    candidates.push_back(dir);
+                }
+            }
+        } else {
+            candidates = defaults;
+        }
+        return existing(candidates);
+    }
+
+    // "git-commit.1.gz" -> ("git-commit", "1")
+    std::pair<std::string, std::string> page_name(std::string file) {
+        for (const char* ext : {".gz", ".bz2", ".xz", ".lzma", ".zst", ".Z"}) {
+            if (utils::ends_with(file, ext)) {
+                file = file.substr(0, file.size() - std::strlen(ext));
+                break;
+            }
+        }
+        size_t dot = file.rfind('.');
+        if (dot == std::string::npos || dot == 0 || dot + 1 >= file.size() ||
+            (!std::isdigit(static_cast<unsigned char>(file[dot + 1])) && file[dot + 1] != 'n')) {
+            return {"", ""};
+        }
+        return {file.substr(0, dot), file.substr(dot + 1)};
+    }
+
+    // Page name -> sections over roots, named after them
+    std::unique_ptr<cache::IndexReader> open_roots(const std::string& name, const std::vector<std::string>& roots,
+                                                   bool shareable) {
+        // Section directories change when pages are installed; the roots
+        // only when a section appears
+        std::vector<std::string> stamped;
+        for (const auto& root : roots) {
+            stamped.push_back(root);
+            for (const auto& sub : stream::list_dir(root)) {
+                if (utils::starts_with(sub, "man")) stamped.push_back(root + "/" + sub);
+            }
+        }
+        return cache::open_index(name, cache::combined_stamp(stamped), [&](cache::IndexWriter& writer) {
+            scan::Options options;
+            // Localized trees (/usr/share/man/de/man1) repeat the same names
+            options.max_depth = 1;
+            cache::HashMapBuilder pages;
+            for (const auto& dir : scan::walk(roots, options)) {
+                std::string base = dir.path.substr(dir.path.rfind('/') + 1);
+                if (!utils::starts_with(base, "man")) continue;
+                for (const auto& file : dir.files) {
+                    auto [page, section] = page_name(file);
+                    if (!page.empty()) pages.add(page, section);
+                }
+            }
+            writer.add_section(cache::section_id("MANP"), pages.serialize());
+        }, shareable);
+    }
+
+    struct Page {
+        std::string_view name;
+        std::string_view sections;
+    };
+
+    // Pages by name. The system roots come from the shared index when the
+    // caller's man path includes all of them, and only the rest from a
+    // per-user one; a name in both appears twice, next to each other.
+    const std::vector<Page>& pages() {
+        static std::unique_ptr<cache::IndexReader> shared, user;
+        static std::vector<Page> list;
+        if (shared || user) return list;
+
+        auto system = system_roots();
+        if (cache::building_system()) {
+            shared = open_roots("man-system.idx", system, true);
+        } else {
+            auto roots = manpath();
+            bool covered = !system.empty() && std::all_of(system.begin(), system.end(), [&](const std::string& dir) {
+                return std::find(roots.begin(), roots.end(), dir) != roots.end();
+            });
+            std::vector<std::string> rest;
+            for (const auto& root : roots) {
+                if (!covered || std::find(system.begin(), system.end(), root) == system.end()) rest.push_back(root);
+            }
+            if (covered) shared = open_roots("man-system.idx", system, true);
+            user = open_roots(cache::hashed_name("man", utils::join(rest, ":")) + ".idx", rest, false);
+        }
+
+        for (const auto* reader : {shared.get(), user.get()}) {
+            if (!reader) continue;
+            cache::HashMapView view(reader->section(cache::section_id("MANP")));
+            for (uint32_t i = 0; i < view.size(); i++) list.push_back({view.key(i), view.value(i)});
+        }
+        std::stable_sort(list.begin(), list.end(), [](const Page& a, const Page& b) { return a.name < b.name; });
+        return list;
+    }
+}
+
+RULE_CLASS(ManNoEntryRule);
+bool ManNoEntryRule::match(const Command& cmd) const {
+    return utils::contains(cmd.output, "No manual entry for ") &&
+           !cmd.script_parts.empty() &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> ManNoEntryRule::get_new_command(const Command& cmd) const {
+    // "No manual entry for gti" or "... for prinf in section 3"
+    std::string typo = project::extract_quoted(std::string(cmd.output) + "\n", "No manual entry for", " ", " \n");
+    auto it = std::find(cmd.script_parts.begin(), cmd.script_parts.end(), typo);
+    if (typo.empty() || it == cmd.script_parts.end()) return {};
+
+    // Keep to the requested section: "3" also covers "3p" and "3ssl"
+    std::string section = project::extract_quoted(std::string(cmd.output) + "\n", "in section", " ", " \n");
+    const auto& pages = man::pages();
+    std::vector<std::string_view> names;
+    names.reserve(pages.size());
+    for (const auto& page : pages) {
+        if (!names.empty() && names.back() == page.name) continue;
+        if (!section.empty()) {
+            auto sections = utils::split(std::string(page.sections), '\n');
+            bool in_section = std::any_of(sections.begin(), sections.end(), [&](const std::string& s) {
+                return utils::starts_with(s, section);
+            });
+            if (!in_section) continue;
+        }
+        names.push_back(page.name);
+    }
+
+    std::vector<std::string> suggestions;
+    for (const auto& match : fuzzy::closest_matches(typo, names)) {
+        auto parts = cmd.script_parts;
+        parts[it - cmd.script_parts.begin()] = match.command;
+        suggestions.push_back(utils::join(parts));
+    }
+    return suggestions;
+}
+
+// Names of running processes, read straight from /proc
+namespace procs {
+    struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    // Numeric entries of /proc, listed with raw getdents64 so no DIR
+    // stream or per-entry allocation is involved
+    std::vector<uint32_t> pids(int proc_fd) {
+        std::vector<uint32_t> result;
+        alignas(linux_dirent64) char buffer[32768];
+        long n;
+        while ((n = syscall(SYS_getdents64, proc_fd, buffer, sizeof(buffer))) > 0) {
+            for (long offset = 0; offset < n;) {
+                auto* entry = reinterpret_cast<linux_dirent64*>(buffer + offset);
+                offset += entry->d_reclen;
+                uint32_t pid = 0;
+                const char* c = entry->d_name;
+                for (; *c >= '0' && *c <= '9'; c++) pid = pid * 10 + (*c - '0');
+                if (*c == '\0' && pid > 0) result.push_back(pid);
+            }
+        }
+        return result;
+    }
+
+    // Read at most size bytes of /proc/<pid>/<file>
+    size_t read_small(int proc_fd, uint32_t pid, const char* file, char* buffer, size_t size) {
+        char path[32];
+        std::snprintf(path, sizeof(path), "%u/%s", pid, file);
+        int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        ssize_t n = pread(fd, buffer, size, 0);
+        close(fd);
+        return n > 0 ? static_cast<size_t>(n) : 0;
+    }
+
+    // Distinct process names. comm is cut at 15 characters, so truncated
+    // names are completed from the basename of argv[0]. The scan stops at
+    // the budget: a correction from most processes beats a slow one.
+    std::vector<std::string> names(std::chrono::milliseconds budget = std::chrono::milliseconds(10)) {
+        int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (proc_fd < 0) return {};
+        // Newest first, so a cut-off scan still covers what the user started
+        auto all = pids(proc_fd);
+        std::sort(all.rbegin(), all.rend());
+
+        std::vector<std::set<std::string>> found(std::max(1u, std::min(8u, std::thread::hardware_concurrency())));
+        // Small hosts are not worth a thread
+        if (all.size() < 512) found.resize(1);
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        auto worker = [&](size_t slot) {
+            char comm[64];
+            char cmdline[256];
+            for (size_t i = slot, checked = 0; i < all.size(); i += found.size()) {
+                if (++checked % 64 == 0 && std::chrono::steady_clock::now() > deadline) break;
+                size_t n = read_small(proc_fd, all[i], "comm", comm, sizeof(comm));
+                if (n == 0) continue;
+                if (comm[n - 1] == '\n') n--;
+                std::string name(comm, n);
+
+                if (n == 15) {
+                    size_t length = read_small(proc_fd, all[i], "cmdline", cmdline, sizeof(cmdline));
+                    std::string_view argv0(cmdline, strnlen(cmdline, length));
+                    argv0 = argv0.substr(argv0.rfind('/') + 1);
+                    if (argv0.size() > n && argv0.substr(0, n) == name) name = std::string(argv0);
+                }
+                if (!name.empty()) found[slot].insert(std::move(name));
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t slot = 1; slot < found.size(); slot++) threads.emplace_back(worker, slot);
+        worker(0);
+        for (auto& thread : threads) thread.join();
+        close(proc_fd);
+
+        std::set<std::string> merged;
+        for (auto& names : found) merged.insert(names.begin(), names.end());
+        return {merged.begin(), merged.end()};
+    }
+
+    // Index of the process name argument, skipping options and their values
+    std::optional<size_t> target(const Command& cmd) {
+        static const std::set<std::string> with_value = {
+            "-s", "--signal", "-u", "--user", "-U", "--uid", "-g", "--group", "-G", "--pgroup",
+            "-P", "--parent", "-t", "--terminal", "-F", "--pidfile", "-o", "--older-than",
+            "-y", "--younger-than", "--ns", "--nslist", "-d", "--delimiter", "-Z", "--context"};
+        std::optional<size_t> found;
+        size_t tool = cmd.script_parts[0] == "sudo" ? 1 : 0;
+        for (size_t i = tool + 1; i < cmd.script_parts.size(); i++) {
+            const std::string& part = cmd.script_parts[i];
+            if (with_value.count(part)) {
+                i++;
+            } else if (part[0] != '-') {
+                found = i;
+            }
+        }
+        return found;
+    }
+
+    bool is_process_command(const Command& cmd) {
+        if (cmd.script_parts.empty()) return false;
+        size_t tool = cmd.script_parts[0] == "sudo" && cmd.script_parts.size() > 1 ? 1 : 0;
+        std::string name = cmd.script_parts[tool].substr(cmd.script_parts[tool].rfind('/') + 1);
+        return name == "pkill" || name == "killall" || name == "pgrep" || name == "pidof" || name == "kill";
+    }
+}
+
+RULE_CLASS(ProcessNameRule);
+bool ProcessNameRule::match(const Command& cmd) const {
+    // pkill, pgrep and pidof say nothing when no process matches, but
+    // neither do they when one does: only a failed run counts. kill
+    // rejects a name where it expects a pid
+    return procs::is_process_command(cmd) &&
+           ((cmd.output.empty() && cmd.exit_status > 0) ||
+            utils::contains(cmd.output, "no process found") ||
+            utils::contains(cmd.output, "arguments must be process or job IDs") ||
+            utils::contains(cmd.output, "failed to parse argument")) &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> ProcessNameRule::get_new_command(const Command& cmd) const {
+    auto index = procs::target(cmd);
+    if (!index) return {};
+    const std::string& typo = cmd.script_parts[*index];
+    if (std::all_of(typo.begin(), typo.end(), ::isdigit) || typo[0] == '%') return {};
+
+    auto names = procs::names();
+    std::vector<std::string> fixes;
+    for (const auto& match : fuzzy::closest_matches(typo, names)) fixes.push_back(match.command);
+
+    // kill takes pids: send the same signal by name instead
+    size_t tool = cmd.script_parts[0] == "sudo" ? 1 : 0;
+    bool by_pid = cmd.script_parts[tool] == "kill";
+    if (by_pid && std::binary_search(names.begin(), names.end(), typo)) fixes.insert(fixes.begin(), typo);
+
+    std::vector<std::string> suggestions;
+    for (const auto& fix : fixes) {
+        auto parts = cmd.script_parts;
+        parts[*index] = fix;
+        if (by_pid) parts[tool] = "pkill";
+        suggestions.push_back(utils::join(parts));
+    }
+    return suggestions;
+}
+
+// Host names the user has configured or connected to, from ssh_config and
+// known_hosts; nothing on the correction path touches DNS
+namespace ssh {
+    // Host lines of an ssh_config file, following Include
+    void scan_config(const std::string& path, const std::string& ssh_dir, cache::NameList& list,
+                     std::set<std::string>& hosts, int depth) {
+        list.sources.push_back(cache::stamp_of(path));
+        if (depth > 8) return;
+
+        stream::for_each_line(path, [&](std::string_view raw) {
+            std::string line(raw);
+            std::replace(line.begin(), line.end(), '=', ' ');
+            std::istringstream iss(line);
+            std::string keyword;
+            iss >> keyword;
+            keyword = utils::to_lower(keyword);
+            if (keyword != "host" && keyword != "include") return;
+
+            std::string word;
+            while (iss >> word) {
+                if (word[0] == '#') break;
+                if (keyword == "host") {
+                    // Patterns and negations name no single host
+                    if (word.find_first_of("*?!") == std::string::npos) hosts.insert(word);
+                    continue;
+                }
+                if (word[0] == '~') {
+                    const char* home = std::getenv("HOME");
+                    word = std::string(home ? home : "") + word.substr(1);
+                } else if (word[0] != '/') {
+                    word = ssh_dir + "/" + word;
+                }
+                glob_t matches;
+                if (glob(word.c_str(), 0, nullptr, &matches) == 0) {
+                    for (size_t i = 0; i < matches.gl_pathc; i++) {
+                        scan_config(matches.gl_pathv[i], ssh_dir, list, hosts, depth + 1);
+                    }
+                }
+                globfree(&matches);
+                // The directory is stamped so new included files are noticed
+                list.sources.push_back(cache::stamp_of(utils::dirname(word)));
+            }
+        });
+    }
+
+    // Host fields of known_hosts; hashed entries (|1|...) cannot be read back
+    void scan_known_hosts(const std::string& path, cache::NameList& list, std::set<std::string>& hosts) {
+        list.sources.push_back(cache::stamp_of(path));
+        stream::for_each_line(path, [&](std::string_view line) {
+            std::istringstream iss{std::string(line)};
+            std::string field;
+            iss >> field;
+            // @cert-authority and @revoked put the hosts in the second field
+            if (!field.empty() && field[0] == '@') iss >> field;
+            if (field.empty() || field[0] == '#' || field[0] == '|') return;
+
+            for (auto host : utils::split(field, ',')) {
+                // [host]:port
+                if (host[0] == '[') host = host.substr(1, host.find(']') - 1);
+                if (!host.empty() && host.find_first_of("*?!") == std::string::npos) hosts.insert(host);
+            }
+        });
+    }
+
+    std::vector<std::string> hosts() {
+        const char* home = std::getenv("HOME");
+        std::string ssh_dir = std::string(home ? home : "") + "/.ssh";
+        return cache::cached_names("ssh", ssh_dir, [&]() {
+            cache::NameList list;
+            std::set<std::string> hosts;
+            scan_config(ssh_dir + "/config", ssh_dir, list, hosts, 0);
+            scan_config("/etc/ssh/ssh_config", "/etc/ssh", list, hosts, 0);
+            scan_known_hosts(ssh_dir + "/known_hosts", list, hosts);
+            scan_known_hosts("/etc/ssh/ssh_known_hosts", list, hosts);
+            list.names.assign(hosts.begin(), hosts.end());
+            return list;
+        });
+    }
+
+    // "ssh: Could not resolve hostname prdo-db1: Name or service not known"
+    std::string unresolved_host(std::string_view output) {
+        return project::extract_quoted(output, "Could not resolve hostname", " ", ":\n");
+    }
+}
+
+RULE_CLASS(SshUnknownHostRule);
+bool SshUnknownHostRule::match(const Command& cmd) const {
+    return !cmd.script_parts.empty() &&
+           utils::contains(cmd.output, "Could not resolve hostname") &&
+           !get_new_command(cmd).empty();
+}
+std::vector<std::string> SshUnknownHostRule::get_new_command(const Command& cmd) const {
+    std::string host = ssh::unresolved_host(cmd.output);
+    if (host.empty()) return {};
+
+    // The host appears as host, user@host, host:path or user@host:path
+    size_t index = cmd.script_parts.size();
+    for (size_t i = 1; i < cmd.script_parts.size(); i++) {
+        const std::string& part = cmd.script_parts[i];
+        size_t start = part.find('@') == std::string::npos ? 0 : part.find('@') + 1;
+        if (part.compare(start, host.size(), host) == 0 &&
+            (start + host.size() == part.size() || part[start + host.size()] == ':')) {
+            index = i;
+            break;
+        }
+    }
+    if (index == cmd.script_parts.size()) return {};
+
+    std::vector<std::string> suggestions;
+    for (const auto& match : fuzzy::closest_matches(host, ssh::hosts())) {
+        auto parts = cmd.script_parts;
+        std::string& part = parts[index];
+        size_t start = part.find('@') == std::string::npos ? 0 : part.find('@') + 1;
+        part.replace(start, host.size(), match.command);
+        suggestions.push_back(utils::join(parts));
+    }
+    return suggestions;
+}
+
+// Rule Manager
+class RuleManager {
+private:
+    std::vector<std::unique_ptr<Rule>> rules;
+
+public:
+    RuleManager() {
+        // Register all rules
+        rules.push_back(std::make_unique<SudoRule>());
+        // A segmentation into tool + subcommand is more specific than a
+        // near-miss command name
+        rules.push_back(std::make_unique<WrongHyphenBeforeSubcommandRule>());
+        rules.push_back(std::make_unique<MissingSpaceBeforeSubcommandRule>());
+        rules.push_back(std::make_unique<FuzzyCommandRule>());
+        rules.push_back(std::make_unique<GitPushRule>());
+        rules.push_back(std::make_unique<NoCommandRule>());
+        rules.push_back(std::make_unique<GitNotCommandRule>());
+        rules.push_back(std::make_unique<CdMkdirRule>());
+        rules.push_back(std::make_unique<CdParentRule>());
+        rules.push_back(std::make_unique<CdCsRule>());
+        rules.push_back(std::make_unique<CatDirRule>());
+        rules.push_back(std::make_unique<ChmodXRule>());
+        rules.push_back(std::make_unique<CpOmittingDirectoryRule>());
         rules.push_back(std::make_unique<DryRule>());
         rules.push_back(std::make_unique<GitAddRule>());
         rules.push_back(std::make_unique<GitAddForceRule>());
@@ -824,28 +5770,47 @@ public:
         rules.push_back(std::make_unique<NpmWrongCommandRule>());
         rules.push_back(std::make_unique<PipUnknownCommandRule>());
         rules.push_back(std::make_unique<GitCloneGitCloneRule>());
-        rules.push_back(std::make_unique<WrongHyphenBeforeSubcommandRule>());
-        rules.push_back(std::make_unique<MissingSpaceBeforeSubcommandRule>());
         rules.push_back(std::make_unique<RemoveShellPromptLiteralRule>());
         rules.push_back(std::make_unique<TouchRule>());
         rules.push_back(std::make_unique<UnsudoRule>());
         rules.push_back(std::make_unique<LnSOrderRule>());
         rules.push_back(std::make_unique<Cpp11Rule>());
         rules.push_back(std::make_unique<GitMainMasterRule>());
-
-        // Sort by priority
-        std::sort(rules.begin(), rules.end(),
-                  [](const auto& a, const auto& b) {
-                      return a->get_priority() < b->get_priority();
+        rules.push_back(std::make_unique<NpmMissingScriptRule>());
+        rules.push_back(std::make_unique<MakeNoRuleRule>());
+        rules.push_back(std::make_unique<CargoNoBinRule>());
+        rules.push_back(std::make_unique<CommandNotFoundPackageRule>());
+        rules.push_back(std::make_unique<UnknownPackageRule>());
+        rules.push_back(std::make_unique<LinkerMissingLibraryRule>());
+        rules.push_back(std::make_unique<MissingHeaderRule>());
+        rules.push_back(std::make_unique<SharedLibraryNotFoundRule>());
+        rules.push_back(std::make_unique<PythonModuleNotFoundRule>());
+        rules.push_back(std::make_unique<SystemdUnitNotFoundRule>());
+        rules.push_back(std::make_unique<ManNoEntryRule>());
+        rules.push_back(std::make_unique<ProcessNameRule>());
+        rules.push_back(std::make_unique<SshUnknownHostRule>());
+
+        // Drop disabled rules so they are never consulted
+        const auto& settings = Settings::instance();
+        rules.erase(std::remove_if(rules.begin(), rules.end(), [&](const auto& rule) {
+                        return !settings.is_rule_enabled(rule->get_name(), rule->is_enabled_by_default());
+                    }), rules.end());
+
+        // Sort by priority, registration order breaks ties
+        std::stable_sort(rules.begin(), rules.end(),
+                  [&](const auto& a, const auto& b) {
+                      return settings.rule_priority(a->get_name(), a->get_priority()) <
+                             settings.rule_priority(b->get_name(), b->get_priority());
                   });
     }
 
-    std::vector<std::string> get_corrected_commands(const Command& cmd) {
+    std::vector<std::string> get_corrected_commands(const Command& cmd, std::string* matched_rule = nullptr) {
         for (const auto& rule : rules) {
             if (rule->match(cmd)) {
                 if (Settings::instance().debug) {
                     // std::cerr << "Matched rule: " << rule->get_name() << std::endl;
                 }
+                if (matched_rule) *matched_rule = rule->get_name();
                 return rule->get_new_command(cmd);
             }
         }
@@ -854,71 +5819,593 @@ public:
 };
 
 std::string get_last_command() {
-    const char* shell = std::getenv("SHELL");
     const char* home = std::getenv("HOME");
 
     if (!home) return "";
 
-    std::string histfile;
-    bool is_zsh = shell && std::string(shell).find("zsh") != std::string::npos;
+    auto usable = [](std::string& cmd) {
+        // Trim leading/trailing whitespace
+        size_t start = cmd.find_first_not_of(" \t\n\r");
+        size_t end = cmd.find_last_not_of(" \t\n\r");
+        if (start == std::string::npos) return false;
+        cmd = cmd.substr(start, end - start + 1);
 
-    if (is_zsh) {
-        histfile = std::string(home) + "/.zsh_history";
-    } else {
-        histfile = std::string(home) + "/.bash_history";
-    }
+        // Skip shit commands
+        return cmd.find("shit") == std::string::npos &&
+               cmd.find("nano") == std::string::npos;
+    };
 
-    std::ifstream file(histfile);
+    // Walk back from the end of the file to the newest usable record
+    auto source = history::current_source();
+    cache::MappedFile file(source.path);
     std::string last_line;
-    std::string line;
+    int remaining = Settings::instance().history_limit;
+    history::for_each_reverse(source.format, file.data(), [&](const history::Entry& entry) {
+        std::string cmd = entry.text();
+        if (!usable(cmd)) return --remaining > 0;
+        last_line = cmd;
+        return false;
+    });
+    return last_line;
+}
 
-    while (std::getline(file, line)) {
-        if (line.empty()) continue;
+// Build the indices shared by all users (run as root, e.g. from a
+// package hook or a daily timer)
+bool build_system_index() {
+    cache::building_system() = true;
+    bool ok = fuzzy::build_system_path_index();
+    packages::file_index();
+    package_names::index();
+    man::pages();
+    if (Settings::instance().debug) {
+        std::cerr << "Built system indices in " << cache::system_directory() << "\n";
+    }
+    return ok;
+}
 
-        std::string cmd = line;
+// Reruns of the failed command, made non-interactive: no controlling
+// terminal, stdin from /dev/null, pagers replaced by cat, credential
+// prompts off, and killed after wait_command seconds. Anything that would
+// still ask for input fails at once instead of stalling shit.
+namespace rerun {
+    struct Tool {
+        std::string name;
+        // Extra environment for this tool
+        std::vector<std::pair<std::string, std::string>> env;
+        // Inserted right after the tool name
+        std::string args;
+    };
+
+    const std::vector<std::pair<std::string, std::string>>& common_env() {
+        static const std::vector<std::pair<std::string, std::string>> env = {
+            {"PAGER", "cat"}, {"MANPAGER", "cat"}, {"SYSTEMD_PAGER", "cat"}, {"GIT_PAGER", "cat"},
+            {"LESS", "-FRX"}, {"TERM", "dumb"}, {"GIT_TERMINAL_PROMPT", "0"},
+            {"DEBIAN_FRONTEND", "noninteractive"}, {"SSH_ASKPASS_REQUIRE", "never"},
+        };
+        return env;
+    }
+
+    const std::vector<Tool>& tools() {
+        static const std::vector<Tool> table = {
+            {"sudo", {}, "-n"},
+            {"git", {{"GIT_ASKPASS", "true"}, {"GIT_SSH_COMMAND", "ssh -o BatchMode=yes"}}, ""},
+            {"ssh", {}, "-o BatchMode=yes"},
+            {"scp", {}, "-o BatchMode=yes"},
+            {"sftp", {}, "-o BatchMode=yes"},
+            {"systemctl", {{"SYSTEMD_PAGER", ""}}, "--no-ask-password"},
+            {"journalctl", {{"SYSTEMD_PAGER", ""}}, "--no-pager"},
+            {"npm", {{"npm_config_yes", "false"}}, ""},
+            {"apt", {}, ""},
+            {"apt-get", {}, ""},
+        };
+        return table;
+    }
 
-        // For zsh: format is `: timestamp:0;command`
-        if (is_zsh) {
-            size_t semicolon_pos = line.rfind(';');
-            if (semicolon_pos != std::string::npos) {
-                cmd = line.substr(semicolon_pos + 1);
+    // cmd with per-tool arguments added, collecting the tool environment.
+    // Only the leading command (after sudo) is rewritten.
+    std::string prepare(const std::string& cmd, std::vector<std::pair<std::string, std::string>>& env) {
+        std::string result = cmd;
+        size_t pos = result.find_first_not_of(" \t");
+        while (pos != std::string::npos && pos < result.size()) {
+            size_t end = result.find_first_of(" \t", pos);
+            if (end == std::string::npos) end = result.size();
+            std::string word = result.substr(pos, end - pos);
+            std::string name = word.substr(word.rfind('/') + 1);
+
+            auto tool = std::find_if(tools().begin(), tools().end(), [&](const Tool& t) { return t.name == name; });
+            if (tool == tools().end()) break;
+            // The user's own settings (a custom GIT_SSH_COMMAND) are kept
+            for (const auto& entry : tool->env) {
+                if (!std::getenv(entry.first.c_str())) env.push_back(entry);
+            }
+            if (!tool->args.empty() && result.compare(end, tool->args.size() + 1, " " + tool->args) != 0) {
+                result.insert(end, " " + tool->args);
+                end += tool->args.size() + 1;
+            }
+            // sudo runs the next word; look at it too
+            if (name != "sudo") break;
+            pos = result.find_first_not_of(" \t", end);
+            while (pos != std::string::npos && result[pos] == '-') {
+                bool takes_value = result.compare(pos, 3, "-u ") == 0 || result.compare(pos, 3, "-g ") == 0;
+                pos = result.find_first_not_of(" \t", result.find_first_of(" \t", pos));
+                if (takes_value && pos != std::string::npos) {
+                    pos = result.find_first_not_of(" \t", result.find_first_of(" \t", pos));
+                }
             }
         }
+        return result;
+    }
 
-        // Trim leading/trailing whitespace
-        size_t start = cmd.find_first_not_of(" \t\n\r");
-        size_t end = cmd.find_last_not_of(" \t\n\r");
+    // Blocks until pid exits (it is not reaped) or the time runs out. A
+    // pidfd can be polled; without one (kernels before 5.3) waitid is
+    // retried with growing sleeps.
+    void wait_exit(pid_t pid, std::chrono::steady_clock::time_point until) {
+        auto left_ms = [&]() {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - std::chrono::steady_clock::now());
+            return std::max<long>(0, left.count());
+        };
+#ifdef SYS_pidfd_open
+        int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        if (pidfd >= 0) {
+            struct pollfd pfd = {pidfd, POLLIN, 0};
+            while (poll(&pfd, 1, static_cast<int>(left_ms())) < 0 && errno == EINTR) {}
+            close(pidfd);
+            return;
+        }
+#endif
+        for (long sleep_us = 100;; sleep_us = std::min(sleep_us * 2, 50000L)) {
+            siginfo_t info{};
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == pid) return;
+            long left = left_ms();
+            if (left == 0) return;
+            usleep(std::min(sleep_us, left * 1000));
+        }
+    }
 
-        if (start != std::string::npos) {
-            cmd = cmd.substr(start, end - start + 1);
-        } else {
-            continue;
+    // Output (stdout and stderr) of cmd, or whatever it printed before the
+    // timeout. exit_status gets the shell's status, 128 + signal if killed.
+    std::shared_ptr<capture::Buffer> run(const std::string& cmd, int timeout_seconds, int* exit_status = nullptr) {
+        auto output = std::make_shared<capture::Buffer>();
+        std::vector<std::pair<std::string, std::string>> overrides = common_env();
+        std::string script = prepare(cmd, overrides);
+
+        std::vector<std::string> env;
+        for (char** e = environ; *e; e++) {
+            std::string_view entry(*e);
+            std::string_view key = entry.substr(0, entry.find('='));
+            bool replaced = key == "SUDO_ASKPASS" || std::any_of(overrides.begin(), overrides.end(),
+                                                                 [&](const auto& o) { return o.first == key; });
+            if (!replaced) env.emplace_back(entry);
+        }
+        // Later entries (per tool) win over the common ones
+        std::map<std::string, std::string> merged;
+        for (const auto& [key, value] : overrides) merged[key] = value;
+        for (const auto& [key, value] : merged) env.push_back(key + "=" + value);
+        std::vector<char*> envp;
+        for (auto& entry : env) envp.push_back(entry.data());
+        envp.push_back(nullptr);
+
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) return output;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return output;
+        }
+        if (pid == 0) {
+            // A new session has no controlling terminal, so /dev/tty
+            // prompts (sudo, ssh, gpg) fail instead of waiting
+            setsid();
+            // dup2 clears O_CLOEXEC on the copy only, the original is
+            // closed by execve. When fd 0 was free it is the copy itself.
+            int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (null_fd < 0) _exit(127);
+            if (null_fd == STDIN_FILENO ? fcntl(null_fd, F_SETFD, 0) != 0 : dup2(null_fd, STDIN_FILENO) < 0) {
+                _exit(127);
+            }
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+            const char* argv[] = {"sh", "-c", script.c_str(), nullptr};
+            execve("/bin/sh", const_cast<char**>(argv), envp.data());
+            _exit(127);
+        }
+        close(fds[1]);
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (timeout_seconds > 0 && left.count() <= 0) break;
+            struct pollfd pfd = {fds[0], POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_seconds > 0 ? static_cast<int>(left.count()) : -1);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) break;
+            if (!output->read_from(fds[0])) break;
+        }
+        close(fds[0]);
+
+        // The shell normally exits right after its output ends; give it
+        // until the deadline, or a second without one. It is not reaped
+        // before the kill, so its process group id can't be reused by then.
+        auto grace = timeout_seconds > 0 ? deadline : std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        wait_exit(pid, grace);
+
+        // Still running after the timeout, or holding the pipe open from a
+        // background child: stop the whole session
+        kill(-pid, SIGKILL);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (exit_status) *exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        return output;
+    }
+}
+
+// Execute command and capture output
+std::shared_ptr<const capture::Buffer> execute_command(const std::string& cmd, int* exit_status = nullptr) {
+    return rerun::run(cmd, Settings::instance().wait_command, exit_status);
+}
+
+// Inside tmux the failed command's output is usually still on screen, so
+// it can be read back from the pane instead of running the command again
+namespace tmux {
+    constexpr int SCROLLBACK_LINES = 5000;
+
+    std::string_view trim_right(std::string_view line) {
+        size_t end = line.find_last_not_of(" \t\r");
+        return end == std::string_view::npos ? std::string_view() : line.substr(0, end + 1);
+    }
+
+    // The prompt line that ran cmd: cmd after the prompt, followed by
+    // nothing or by a right prompt. The prompt has to end in a prompt
+    // character, so "zsh: command not found: gti" isn't the line for gti
+    bool is_prompt_for(std::string_view line, std::string_view cmd) {
+        size_t pos = line.rfind(cmd);
+        if (pos == std::string_view::npos) return false;
+        std::string_view rest = line.substr(pos + cmd.size());
+        if (!rest.empty() && !utils::starts_with(rest, "  ")) return false;
+        if (pos == 0) return true;
+
+        std::string_view prompt = line.substr(0, pos);
+        if (prompt.back() != ' ' && prompt.back() != '\t') return false;
+        prompt = trim_right(prompt);
+        for (const char* end : {"$", "%", "#", ">", "]", ")", "\u276f", "\u00bb", "\u279c", "\u03bb"}) {
+            if (utils::ends_with(prompt, end)) return true;
         }
+        return false;
+    }
 
-        // Skip empty commands and shit commands
-        if (!cmd.empty() && cmd.find("shit") == std::string::npos &&
-            cmd.find("nano") == std::string::npos) {
-            last_line = cmd;
+    // What cmd printed, cut from the pane text: the lines between the last
+    // prompt showing cmd and the prompt shit was started from
+    std::optional<std::string> slice(std::string_view pane, const std::string& cmd) {
+        std::vector<std::string_view> lines;
+        for (size_t start = 0; start < pane.size();) {
+            size_t end = pane.find('\n', start);
+            if (end == std::string_view::npos) end = pane.size();
+            lines.push_back(trim_right(pane.substr(start, end - start)));
+            start = end + 1;
+        }
+        while (!lines.empty() && lines.back().empty()) lines.pop_back();
+        if (lines.size() < 2) return std::nullopt;
+
+        // The last line is the prompt shit was typed at
+        for (size_t i = lines.size() - 1; i-- > 0;) {
+            if (!is_prompt_for(lines[i], cmd)) continue;
+            // A line the command printed again further down is output
+            if (std::find(lines.begin() + i + 1, lines.end() - 1, lines[i]) != lines.end() - 1) continue;
+            std::string output;
+            for (size_t j = i + 1; j + 1 < lines.size(); j++) {
+                output.append(lines[j]);
+                output += '\n';
             }
+            // Nothing to go on (or the wrong line); running it again is
+            // the safer answer
+            if (output.empty()) return std::nullopt;
+            return output;
+        }
+        return std::nullopt;
     }
 
-    return last_line;
+    std::shared_ptr<const capture::Buffer> scrollback_output(const std::string& cmd) {
+        const char* session = std::getenv("TMUX");
+        const char* pane = std::getenv("TMUX_PANE");
+        if (!session || !*session || !pane || pane[0] != '%' ||
+            std::string_view(pane + 1).find_first_not_of("0123456789") != std::string_view::npos) {
+            return nullptr;
+        }
+
+        // -J joins wrapped lines, so long commands still match their prompt
+        auto captured = rerun::run("tmux capture-pane -p -J -S -" + std::to_string(SCROLLBACK_LINES) +
+                                   " -t '" + pane + "'", 1);
+        auto output = slice(captured->view(), cmd);
+        if (!output) return nullptr;
+        return std::make_shared<capture::Buffer>(*output);
+    }
 }
 
-// Execute command and capture output
-std::string execute_command(const std::string& cmd) {
-    std::string result;
-    FILE* pipe = popen((cmd + " 2>&1").c_str(), "r");
-    if (!pipe) return "";
+// Output of the last command: read back from the terminal when possible,
+// otherwise by running it again (exit_status stays -1 for the former)
+std::shared_ptr<const capture::Buffer> get_command_output(const std::string& cmd, int* exit_status = nullptr) {
+    bool debug = Settings::instance().debug;
+    auto trace = [&](const char* provider, auto start, const std::shared_ptr<const capture::Buffer>& output) {
+        if (!debug) return;
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        std::cerr << "Output from " << provider << ": " << (output ? std::to_string(output->view().size()) + " bytes" : "none")
+                  << " in " << elapsed.count() << "us\n";
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (std::getenv("TMUX")) {
+        auto output = tmux::scrollback_output(cmd);
+        trace("tmux", start, output);
+        if (output) return output;
+        start = std::chrono::steady_clock::now();
+    }
+    auto output = execute_command(cmd, exit_status);
+    trace("rerun", start, output);
+    return output;
+}
+
+// Opt-in log of real runs (record = true), so that rule changes can be
+// profiled and compared against the failures people actually hit instead
+// of made-up ones. sessions.log is the magic followed by records of
+// u32 length, u8 flags, payload; the payload is zlib compressed when
+// built with THESHIT_ZLIB and the COMPRESSED flag is set.
+namespace recorder {
+    constexpr char MAGIC[8] = {'S', 'H', 'I', 'T', 'L', 'O', 'G', '1'};
+    constexpr uint8_t COMPRESSED = 1;
+    // Rules rarely look past the first and last few KB of output
+    constexpr size_t WINDOW = 4096;
+    // Larger records can only come from a corrupt or foreign log
+    constexpr uint64_t MAX_RECORD = 16 << 20;
+
+    struct Record {
+        int64_t time = 0;
+        std::string script;
+        std::string cwd;
+        uint64_t path_hash = 0;
+        int32_t exit_status = -1;
+        uint64_t output_size = 0;
+        // The first and last WINDOW bytes of what rules saw; head holds all
+        // of it when it fits in both
+        std::string head;
+        std::string tail;
+        std::string rule;
+        std::string correction;
+        std::vector<std::pair<std::string, uint32_t>> stages_us;
+
+        std::string output() const { return head + tail; }
+    };
+
+    void put(std::string& out, uint64_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void put(std::string& out, std::string_view text) {
+        uint32_t size = text.size();
+        out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.append(text);
+    }
+
+    std::string encode(const Record& record) {
+        std::string out;
+        put(out, static_cast<uint64_t>(record.time));
+        put(out, record.script);
+        put(out, record.cwd);
+        put(out, record.path_hash);
+        put(out, static_cast<uint64_t>(static_cast<int64_t>(record.exit_status)));
+        put(out, record.output_size);
+        put(out, record.head);
+        put(out, record.tail);
+        put(out, record.rule);
+        put(out, record.correction);
+        put(out, static_cast<uint64_t>(record.stages_us.size()));
+        for (const auto& [stage, us] : record.stages_us) {
+            put(out, stage);
+            put(out, static_cast<uint64_t>(us));
+        }
+        return out;
+    }
+
+    // Bounds-checked reads; any short field fails the whole record
+    struct Cursor {
+        std::string_view data;
+        bool ok = true;
+
+        uint64_t number() {
+            if (data.size() < 8) return ok = false, 0;
+            auto value = cache::load<uint64_t>(data.data());
+            data.remove_prefix(8);
+            return value;
+        }
+
+        std::string text() {
+            if (data.size() < 4) return ok = false, "";
+            size_t size = cache::load<uint32_t>(data.data());
+            if (data.size() - 4 < size) return ok = false, "";
+            std::string value(data.substr(4, size));
+            data.remove_prefix(4 + size);
+            return value;
+        }
+    };
+
+    std::optional<Record> decode(std::string_view payload) {
+        Cursor in{payload};
+        Record record;
+        record.time = static_cast<int64_t>(in.number());
+        record.script = in.text();
+        record.cwd = in.text();
+        record.path_hash = in.number();
+        record.exit_status = static_cast<int32_t>(static_cast<int64_t>(in.number()));
+        record.output_size = in.number();
+        record.head = in.text();
+        record.tail = in.text();
+        record.rule = in.text();
+        record.correction = in.text();
+        uint64_t stages = in.number();
+        for (uint64_t i = 0; in.ok && i < stages; i++) {
+            std::string stage = in.text();
+            record.stages_us.emplace_back(stage, static_cast<uint32_t>(in.number()));
+        }
+        if (!in.ok) return std::nullopt;
+        return record;
+    }
+
+    std::string log_path() {
+        return cache::path_for("sessions.log");
+    }
+
+    uint64_t path_hash() {
+        const char* path = std::getenv("PATH");
+        return utils::fnv1a(path ? path : "");
+    }
+
+    Record make_record(const Command& cmd) {
+        Record record;
+        record.time = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.script = cmd.script;
+        record.cwd = utils::current_dir();
+        record.path_hash = path_hash();
+        record.output_size = cmd.raw_output.size();
+        if (cmd.output.size() <= 2 * WINDOW) {
+            record.head = cmd.output;
+        } else {
+            record.head = cmd.output.substr(0, WINDOW);
+            record.tail = cmd.output.substr(cmd.output.size() - WINDOW);
+        }
+        return record;
+    }
+
+    // One write per record, so concurrent shells don't interleave
+    bool append(const Record& record) {
+        std::string payload = encode(record);
+        uint8_t flags = 0;
+#ifdef THESHIT_ZLIB
+        uLongf size = compressBound(payload.size());
+        std::string packed(sizeof(uint64_t) + size, '\0');
+        uint64_t raw_size = payload.size();
+        std::memcpy(packed.data(), &raw_size, sizeof(raw_size));
+        if (compress2(reinterpret_cast<Bytef*>(packed.data() + sizeof(raw_size)), &size,
+                      reinterpret_cast<const Bytef*>(payload.data()), payload.size(), Z_BEST_SPEED) == Z_OK &&
+            sizeof(raw_size) + size < payload.size()) {
+            packed.resize(sizeof(raw_size) + size);
+            payload = std::move(packed);
+            flags |= COMPRESSED;
+        }
+#endif
+        std::string out;
+        uint32_t length = payload.size();
+        out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        out += static_cast<char>(flags);
+        out += payload;
+
+        int fd = open(log_path().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0) out.insert(0, MAGIC, sizeof(MAGIC));
+        bool ok = write(fd, out.data(), out.size()) == static_cast<ssize_t>(out.size());
+        close(fd);
+        return ok;
+    }
+
+    // Calls fn for every readable record; false if path is not a log.
+    // Compressed records are skipped (and counted) without zlib.
+    bool for_each(const std::string& path, const std::function<void(const Record&)>& fn, size_t* skipped = nullptr) {
+        cache::MappedFile file(path);
+        std::string_view data = file.data();
+        if (data.size() < sizeof(MAGIC) || data.substr(0, sizeof(MAGIC)) != std::string_view(MAGIC, sizeof(MAGIC))) {
+            return false;
+        }
+        data.remove_prefix(sizeof(MAGIC));
+
+        while (data.size() >= 5) {
+            size_t length = cache::load<uint32_t>(data.data());
+            uint8_t flags = data[4];
+            // A torn final write ends the log
+            if (data.size() - 5 < length) break;
+            std::string_view payload = data.substr(5, length);
+            data.remove_prefix(5 + length);
+
+            std::string inflated;
+            if (flags & COMPRESSED) {
+#ifdef THESHIT_ZLIB
+                // The stored size comes from the file: deflate expands at
+                // most about 1032:1, and no record comes near MAX_RECORD
+                uint64_t stored = payload.size() < sizeof(uint64_t) ? 0 : cache::load<uint64_t>(payload.data());
+                if (stored == 0 || stored > MAX_RECORD || stored > (payload.size() - sizeof(uint64_t)) * 1032) {
+                    if (skipped) ++*skipped;
+                    continue;
+                }
+                uLongf size = stored;
+                inflated.resize(size);
+                if (uncompress(reinterpret_cast<Bytef*>(inflated.data()), &size,
+                               reinterpret_cast<const Bytef*>(payload.data() + sizeof(uint64_t)),
+                               payload.size() - sizeof(uint64_t)) != Z_OK) {
+                    if (skipped) ++*skipped;
+                    continue;
+                }
+                inflated.resize(size);
+                payload = inflated;
+#else
+                if (skipped) ++*skipped;
+                continue;
+#endif
+            }
+            if (auto record = decode(payload)) {
+                fn(*record);
+            } else if (skipped) {
+                ++*skipped;
+            }
+        }
+        return true;
+    }
+
+    // Batch mode: run the current rules over a log without executing
+    // anything. One tab separated line per record (evaluation time, rule,
+    // correction, correction at recording time, script), then a summary.
+    int replay(const std::string& path) {
+        std::vector<uint64_t> times;
+        size_t changed = 0, other_path = 0, skipped = 0;
+        uint64_t current_path = path_hash();
+        std::string home_dir = utils::current_dir();
+        RuleManager manager;
+
+        bool ok = for_each(path, [&](const Record& record) {
+            // Project rules look at the working directory
+            bool moved = utils::is_directory(record.cwd) && chdir(record.cwd.c_str()) == 0;
+            Command cmd(record.script, record.output());
+            cmd.exit_status = record.exit_status;
+
+            auto start = std::chrono::steady_clock::now();
+            std::string rule;
+            auto corrections = manager.get_corrected_commands(cmd, &rule);
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            if (moved && chdir(home_dir.c_str()) != 0) return;
+
+            std::string correction = corrections.empty() ? "" : corrections[0];
+            times.push_back(us);
+            changed += correction != record.correction;
+            other_path += record.path_hash != current_path;
+            std::cout << us << "\t" << (rule.empty() ? "-" : rule) << "\t" << correction << "\t"
+                      << record.correction << "\t" << record.script << "\n";
+        }, &skipped);
+        if (!ok) {
+            std::cerr << path << " is not a session log\n";
+            return 1;
+        }
 
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        result += buffer;
+        std::sort(times.begin(), times.end());
+        auto percentile = [&](double p) { return times.empty() ? 0 : times[static_cast<size_t>(p * (times.size() - 1))]; };
+        std::cerr << times.size() << " records, " << changed << " with a different correction, "
+                  << other_path << " recorded with another PATH, " << skipped << " unreadable; "
+                  << "p50 " << percentile(0.5) << "us, p99 " << percentile(0.99) << "us, max "
+                  << (times.empty() ? 0 : times.back()) << "us\n";
+        return 0;
     }
-    pclose(pipe);
-    return result;
 }
 
+// The corpus test includes this file for everything but main
+#ifndef THESHIT_NO_MAIN
 int main(int argc, char* argv[]) {
     bool yes_mode = false;
     bool recursive = false;
@@ -931,16 +6418,32 @@ int main(int argc, char* argv[]) {
         } else if (arg == "-r") {
             recursive = true;
         } else if (arg == "--alias") {
-            std::cout << "alias shit='eval $(theshit $(fc -ln -1))'\n";
+            std::cout << shell::hook(shell::current());
             return 0;
         } else if (arg == "--version") {
             std::cout << "The Shit v1.0.0 (C++ Edition)\n";
             return 0;
+        } else if (arg == "--replay") {
+            return recorder::replay(i + 1 < argc ? argv[i + 1] : recorder::log_path());
+        } else if (arg == "--build-system-index") {
+            if (build_system_index()) return 0;
+            std::cerr << "Cannot write " << cache::system_directory() << "\n";
+            return 1;
         }
     }
 
+    // Per-stage timings for the session log
+    std::vector<std::pair<std::string, uint32_t>> stages_us;
+    auto stage_start = std::chrono::steady_clock::now();
+    auto end_stage = [&](const char* name) {
+        auto now = std::chrono::steady_clock::now();
+        stages_us.emplace_back(name, std::chrono::duration_cast<std::chrono::microseconds>(now - stage_start).count());
+        stage_start = now;
+    };
+
     // Get last command
     std::string last_cmd = get_last_command();
+    end_stage("history");
     if (last_cmd.empty()) {
         // std::cerr << "No previous command found\n";
         return 1;
@@ -949,20 +6452,33 @@ int main(int argc, char* argv[]) {
     // DEBUG: Print what we extracted
     // std::cerr << "DEBUG: Extracted command: [" << last_cmd << "]\n";
 
-    // Execute the command to get its output
-    std::string output = execute_command(last_cmd);
+    int exit_status = -1;
+    auto output = get_command_output(last_cmd, &exit_status);
+    end_stage("output");
 
     // DEBUG: Print the output
-    // std::cerr << "DEBUG: Command output: [" << output << "]\n";
+    // std::cerr << "DEBUG: Command output: [" << output->view() << "]\n";
 
     Command cmd(last_cmd, output);
+    cmd.exit_status = exit_status;
 
     int attempts = 0;
     const int max_attempts = recursive ? 10 : 1;
 
     while (attempts < max_attempts) {
         RuleManager manager;
-        auto corrections = manager.get_corrected_commands(cmd);
+        std::string rule;
+        auto corrections = manager.get_corrected_commands(cmd, &rule);
+
+        if (attempts == 0 && Settings::instance().record) {
+            end_stage("rules");
+            auto record = recorder::make_record(cmd);
+            record.exit_status = exit_status;
+            record.rule = rule;
+            record.correction = corrections.empty() ? "" : corrections[0];
+            record.stages_us = stages_us;
+            recorder::append(record);
+        }
 
         if (corrections.empty()) {
             if (attempts == 0) {
@@ -973,17 +6489,28 @@ int main(int argc, char* argv[]) {
 
         const std::string& correction = corrections[0];
 
+        // Aliases, functions and builtins only exist in the user's shell:
+        // the bare correction goes to stdout for the hook to eval, and
+        // everything else to stderr
+        bool in_shell = fuzzy::runs_in_shell(correction);
+        std::ostream& display = in_shell ? std::cerr : std::cout;
+
         if (!Settings::instance().no_colors) {
-            std::cout << "\033[1;32m" << correction << "\033[0m";
+            display << "\033[1;32m" << correction << "\033[0m";
         } else {
-            std::cout << correction;
+            display << correction;
         }
 
         if (!yes_mode && Settings::instance().require_confirmation) {
-            std::cout << " [enter/↑/↓/ctrl+c]\n";
+            display << " [enter/↑/↓/ctrl+c]\n";
             std::cin.get();
         } else {
-            std::cout << std::endl;
+            display << std::endl;
+        }
+
+        if (in_shell) {
+            std::cout << correction << std::endl;
+            break;
         }
 
         // Execute the corrected command
@@ -994,10 +6521,13 @@ int main(int argc, char* argv[]) {
         }
 
         // Prepare for next iteration in recursive mode
-        output = execute_command(correction);
+        int status = -1;
+        output = execute_command(correction, &status);
         cmd = Command(correction, output);
+        cmd.exit_status = status;
         attempts++;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
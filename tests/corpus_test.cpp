@@ -0,0 +1,324 @@
+// Golden corpus for the rules: every case is a failed command, its output
+// and the first correction expected for it, evaluated in process through
+// RuleManager. Each case also has to finish within a latency ceiling
+// (1ms unless the case says otherwise), so performance work can't quietly
+// change what gets suggested or how long it takes.
+//
+// Everything the rules look at on disk lives in a throwaway directory
+// under $TMPDIR: HOME, the caches, PATH, MANPATH, a Python venv, systemd
+// user units, ssh config and the working directory with its package.json,
+// Makefile and Cargo.toml. Cases that need something only the host has (the package
+// database, system libraries) name it with "@ requires" and are skipped
+// when it is missing.
+#define THESHIT_NO_MAIN
+#include "../main.cpp"
+
+#include <ftw.h>
+
+namespace corpus {
+    struct Case {
+        int line = 0;
+        std::string script;
+        std::string output;
+        std::string expected;
+        std::vector<std::string> requires_paths;
+        std::string priority;
+        // "shell" when the correction has to be handed back to the user's
+        // shell, "system" when shit can run it itself
+        std::string runs;
+        // The command's exit status as the rules see it (-1: unknown)
+        int exit_status = -1;
+        long budget_us = 1000;
+    };
+
+    std::string replace_all(std::string text, const std::string& from, const std::string& to) {
+        for (size_t pos = 0; (pos = text.find(from, pos)) != std::string::npos; pos += to.size()) {
+            text.replace(pos, from.size(), to);
+        }
+        return text;
+    }
+
+    // "$ script" starts a case, "> line" adds an output line (">" alone is
+    // an empty one), "= correction" ends it ("=" alone: no correction).
+    // "@ requires <path>", "@ budget <us>", "@ priority <Rule=N:...>" (the
+    // priority setting the case is evaluated with), "@ exit <status>" and
+    // "@ runs <shell|system>" apply to the open case, and {root} stands
+    // for the sandbox directory.
+    std::vector<Case> load(const std::string& path, const std::string& root, std::string& error) {
+        std::vector<Case> cases;
+        std::ifstream file(path);
+        if (!file) {
+            error = "cannot read " + path;
+            return cases;
+        }
+
+        std::optional<Case> open;
+        bool has_output = false;
+        std::string line;
+        for (int number = 1; std::getline(file, line); number++) {
+            if (line.empty() || line[0] == '#') continue;
+            line = replace_all(line, "{root}", root);
+            std::string body = line.size() > 2 ? line.substr(2) : "";
+
+            if (line[0] == '$') {
+                if (open) {
+                    error = path + ":" + std::to_string(open->line) + ": case has no '=' line";
+                    return {};
+                }
+                open = Case{};
+                open->line = number;
+                has_output = false;
+                open->script = body;
+            } else if (!open) {
+                error = path + ":" + std::to_string(number) + ": expected '$'";
+                return {};
+            } else if (line[0] == '>') {
+                if (has_output) open->output += "\n";
+                open->output += body;
+                has_output = true;
+            } else if (line[0] == '@') {
+                auto words = utils::split(body);
+                if (words.size() == 2 && words[0] == "requires") {
+                    open->requires_paths.push_back(words[1]);
+                } else if (words.size() == 2 && words[0] == "budget") {
+                    open->budget_us = std::stol(words[1]);
+                } else if (words.size() == 2 && words[0] == "exit") {
+                    open->exit_status = std::stoi(words[1]);
+                } else if (words.size() == 2 && words[0] == "priority") {
+                    open->priority = words[1];
+                } else if (words.size() == 2 && words[0] == "runs" && (words[1] == "shell" || words[1] == "system")) {
+                    open->runs = words[1];
+                } else {
+                    error = path + ":" + std::to_string(number) + ": unknown directive";
+                    return {};
+                }
+            } else if (line[0] == '=') {
+                open->expected = body;
+                cases.push_back(std::move(*open));
+                open.reset();
+            } else {
+                error = path + ":" + std::to_string(number) + ": unexpected line";
+                return {};
+            }
+        }
+        if (open) error = path + ":" + std::to_string(open->line) + ": case has no '=' line";
+        return cases;
+    }
+
+    void write_file(const std::string& path, const std::string& content, mode_t mode = 0644) {
+        std::string dir = utils::dirname(path);
+        for (size_t pos = 1; (pos = dir.find('/', pos)) != std::string::npos; pos++) {
+            mkdir(dir.substr(0, pos).c_str(), 0755);
+        }
+        mkdir(dir.c_str(), 0755);
+        std::ofstream(path) << content;
+        chmod(path.c_str(), mode);
+    }
+
+    void make_tool(const std::string& dir, const std::string& name) {
+        write_file(dir + "/" + name, "#!/bin/sh\nexit 0\n", 0755);
+    }
+
+    // The sandbox the corpus expects; returns its root
+    std::string build_sandbox() {
+        const char* tmp = std::getenv("TMPDIR");
+        std::string root_template = std::string(tmp && *tmp ? tmp : "/tmp") + "/theshit-corpus-XXXXXX";
+        if (!mkdtemp(root_template.data())) return "";
+        std::string root = root_template;
+        std::string home = root + "/home";
+        std::string work = root + "/work";
+
+        for (const char* tool : {"git", "git-lfs", "gcc", "g++", "cc", "make", "npm", "yarn", "cargo", "docker",
+                                 "kubectl", "pip", "ls", "grep", "cat", "cp", "mv", "rm", "mkdir", "touch",
+                                 "ln", "chmod", "sleep", "kill", "killall", "pkill", "pgrep", "ssh", "scp",
+                                 "systemctl", "journalctl", "man", "apt", "apt-get", "java", "javac", "go",
+                                 "node", "vim", "clear", "curl", "tar", "less", "htop", "terraform"}) {
+            make_tool(root + "/bin", tool);
+        }
+        symlink("/bin/sleep", (root + "/bin/corpusdaemon").c_str());
+
+        // A venv that doesn't see the host's site-packages
+        write_file(root + "/venv/pyvenv.cfg", "home = /usr/bin\ninclude-system-site-packages = false\n");
+        make_tool(root + "/venv/bin", "python3");
+        std::string site = root + "/venv/lib/python3.11/site-packages";
+        for (const char* module : {"numpy", "requests", "flask", "pandas", "yaml"}) {
+            write_file(site + "/" + module + "/__init__.py", "");
+        }
+        write_file(site + "/six.py", "");
+        write_file(site + "/PyYAML-6.0.dist-info/top_level.txt", "yaml\n");
+        write_file(site + "/ruamel/yaml/__init__.py", "");
+        write_file(site + "/ruamel.yaml-0.17.dist-info/top_level.txt", "ruamel\n");
+
+        for (const char* page : {"man1/git.1.gz", "man1/grep.1.gz", "man1/printf.1.gz", "man1/tar.1.gz",
+                                 "man3/printf.3.gz", "man3/malloc.3.gz", "man5/crontab.5.gz"}) {
+            write_file(root + "/man/" + page, "");
+        }
+
+        std::string units = home + "/.config/systemd/user";
+        for (const char* unit : {"corpus-web.service", "corpus-worker@.service", "corpus-backup.timer",
+                                 "corpus-backup.service"}) {
+            write_file(units + "/" + unit, "[Unit]\n");
+        }
+
+        write_file(home + "/.ssh/config",
+                   "Host prod-db1 prod-db2\n    HostName 10.0.0.1\nHost staging-web\n    User deploy\n");
+        write_file(home + "/.ssh/known_hosts", "[gitlab.corpus.test]:2222 ssh-ed25519 AAAAC3Nza\n");
+        write_file(home + "/.local/lib/libcorpus.so.3", "");
+        // Several majors of one library, as ICU leaves behind
+        for (const char* version : {"70.1", "71", "72", "74", "74.2", "7"}) {
+            write_file(home + "/.local/lib/libcorpusicu.so." + version, "");
+        }
+
+        write_file(work + "/package.json",
+                   "{\n  \"name\": \"corpus\",\n  \"scripts\": {\n    \"test\": \"jest\",\n"
+                   "    \"build\": \"tsc\",\n    \"start\": \"node .\",\n    \"lint\": \"eslint .\"\n  }\n}\n");
+        write_file(work + "/Makefile", "PREFIX ::= /usr/local\nall: build\nbuild:\n\tcc -o app main.c\ninstall: build\n\tcp app /usr/local/bin\n"
+                                       "clean:\n\trm -f app\n.PHONY: all build install clean\n");
+        write_file(work + "/Cargo.toml", "[package]\nname = \"corpus\"\n\n[[bin]]\nname = \"server\"\n"
+                                         "path = \"src/server.rs\"\n");
+        write_file(work + "/src/main.rs", "fn main() {}\n");
+        write_file(work + "/include/corpus/util.h", "");
+        write_file(work + "/main.c", "#include \"corpus/util.h\"\n");
+        write_file(work + "/gui.c", "#include <stdio.h>\n#include \"corpus/utl.h\"\n");
+        write_file(work + "/deploy.sh", "#!/bin/sh\n", 0755);
+        mkdir((work + "/docs").c_str(), 0755);
+
+        std::string path = root + "/venv/bin:" + root + "/bin";
+        setenv("HOME", home.c_str(), 1);
+        setenv("PATH", path.c_str(), 1);
+        setenv("MANPATH", (root + "/man").c_str(), 1);
+        setenv("XDG_CACHE_HOME", (home + "/.cache").c_str(), 1);
+        setenv("XDG_CONFIG_HOME", (home + "/.config").c_str(), 1);
+        setenv("XDG_DATA_HOME", (home + "/.local/share").c_str(), 1);
+        setenv("HISTFILE", (home + "/.bash_history").c_str(), 1);
+        setenv("THESHIT_SYSTEM_CACHE", (root + "/system-cache").c_str(), 1);
+        setenv("SHELL", "/bin/bash", 1);
+        setenv("THESHIT_ALIASES", "glog ll", 1);
+        setenv("THESHIT_FUNCTIONS", "mkcd extract", 1);
+        for (const char* name : {"TMUX", "TMUX_PANE", "LD_LIBRARY_PATH", "PYENV_VERSION", "VIRTUAL_ENV"}) unsetenv(name);
+        for (char** env = environ; *env;) {
+            std::string entry(*env);
+            bool ours = utils::starts_with(entry, "THESHIT_") && !utils::starts_with(entry, "THESHIT_ALIASES=") &&
+                        !utils::starts_with(entry, "THESHIT_FUNCTIONS=") &&
+                        !utils::starts_with(entry, "THESHIT_SYSTEM_CACHE=") &&
+                        !utils::starts_with(entry, "THESHIT_CORPUS_");
+            if (ours) {
+                unsetenv(entry.substr(0, entry.find('=')).c_str());
+            } else {
+                env++;
+            }
+        }
+        if (chdir(work.c_str()) != 0) return "";
+        return root;
+    }
+
+    void remove_tree(const std::string& root) {
+        nftw(root.c_str(), [](const char* path, const struct stat*, int, struct FTW*) { return ::remove(path); },
+             16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: shit_corpus_test <corpus>\n";
+        return 2;
+    }
+    std::string corpus_path = argv[1];
+    if (corpus_path[0] != '/') corpus_path = utils::current_dir() + "/" + corpus_path;
+
+    std::string root = corpus::build_sandbox();
+    if (root.empty()) {
+        std::cerr << "cannot set up the sandbox\n";
+        return 2;
+    }
+
+    // A process for the process-name cases to find
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        execl((root + "/bin/corpusdaemon").c_str(), "corpusdaemon", "600", static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    std::string error;
+    auto cases = corpus::load(corpus_path, root, error);
+    if (!error.empty()) {
+        std::cerr << error << "\n";
+        kill(daemon, SIGKILL);
+        corpus::remove_tree(root);
+        return 2;
+    }
+
+    // Slower builds (sanitizers, no optimization) scale the ceilings
+    double scale = 1.0;
+    if (const char* env = std::getenv("THESHIT_CORPUS_BUDGET_SCALE")) scale = std::atof(env);
+
+    // One manager per priority setting the corpus asks for; rules read the
+    // settings when the manager is built
+    std::map<std::string, std::unique_ptr<RuleManager>> managers;
+    auto manager_for = [&](const std::string& priority) -> RuleManager& {
+        auto& manager = managers[priority];
+        if (!manager) {
+            auto& settings = Settings::instance();
+            auto saved = settings.priority;
+            if (!priority.empty()) settings.apply("priority", priority);
+            manager = std::make_unique<RuleManager>();
+            settings.priority = saved;
+        }
+        return *manager;
+    };
+    auto evaluate = [&](const corpus::Case& c) {
+        Command cmd(c.script, c.output);
+        cmd.exit_status = c.exit_status;
+        auto corrections = manager_for(c.priority).get_corrected_commands(cmd);
+        return corrections.empty() ? std::string() : corrections[0];
+    };
+
+    size_t failed = 0, skipped = 0, checked = 0;
+    std::vector<const corpus::Case*> runnable;
+    for (const auto& c : cases) {
+        bool available = std::all_of(c.requires_paths.begin(), c.requires_paths.end(), utils::file_exists);
+        if (!available) {
+            skipped++;
+            continue;
+        }
+        runnable.push_back(&c);
+        // The first evaluation builds the indices and fills the caches;
+        // it checks the correction but is not timed
+        std::string got = evaluate(c);
+        if (got != c.expected) {
+            std::cerr << corpus_path << ":" << c.line << ": " << c.script << "\n"
+                      << "    expected: " << (c.expected.empty() ? "(nothing)" : c.expected) << "\n"
+                      << "    got:      " << (got.empty() ? "(nothing)" : got) << "\n";
+            failed++;
+        } else if (!c.runs.empty() && c.runs != (fuzzy::runs_in_shell(got) ? "shell" : "system")) {
+            std::cerr << corpus_path << ":" << c.line << ": " << c.script << "\n"
+                      << "    expected " << got << " to run in the " << c.runs << "\n";
+            failed++;
+        }
+    }
+
+    // Best of three, so a stray context switch doesn't fail a case
+    for (const auto* c : runnable) {
+        long best = LONG_MAX;
+        for (int run = 0; run < 3; run++) {
+            auto start = std::chrono::steady_clock::now();
+            evaluate(*c);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min<long>(best, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        }
+        checked++;
+        if (best > c->budget_us * scale) {
+            std::cerr << corpus_path << ":" << c->line << ": " << c->script << "\n"
+                      << "    took " << best << "us, budget " << static_cast<long>(c->budget_us * scale) << "us\n";
+            failed++;
+        }
+    }
+
+    kill(daemon, SIGKILL);
+    waitpid(daemon, nullptr, 0);
+    corpus::remove_tree(root);
+
+    std::cout << cases.size() << " cases, " << checked << " checked, " << skipped << " skipped, "
+              << failed << " failures\n";
+    return failed == 0 ? 0 : 1;
+}